@@ -10,8 +10,8 @@
  *    hwmon: Driver for SCSI/ATA temperature sensors
  *    by Constantin Baranov <const@mimas.ru>, submitted September 2009
  *
- * This drive supports reporting the temperatire of SATA drives. It can be
- * easily extended to report the temperature of SCSI drives.
+ * This drive supports reporting the temperatire of SATA drives and of SCSI
+ * drives implementing the Informational Exceptions log page.
  *
  * The primary means to read drive temperatures and temperature limits
  * for ATA drives is the SCT Command Transport feature set as specified in
@@ -89,32 +89,110 @@
  * Following above definitions, temperatures are reported as follows.
  *   If SCT Command Transport is supported, it is used to read the
  *   temperature and, if available, temperature limits.
+ * - Otherwise, if the General Purpose Logging feature set is supported and
+ *   the Device Statistics log (04h) includes the Temperature Statistics
+ *   page (05h), it is used to read the temperature and, if available,
+ *   the specified operating temperature limits.
  * - Otherwise, if SMART attribute 194 is supported, it is used to read
  *   the temperature.
  * - Otherwise, if SMART attribute 190 is supported, it is used to read
  *   the temperature.
+ *
+ * Non-ATA (typically SAS) drives report the most recent temperature reading
+ * together with the health status (IE ASC/ASCQ) in parameter 0000h of the
+ * Informational Exceptions log page (2Fh), as specified in SPC-4. A single
+ * LOG SENSE command thus serves both temperature and health. If the drive
+ * reports "warning - specified temperature exceeded", temp1_alarm is set.
+ * Other informational exceptions are reported in the kernel log.
  */
 
 #include <linux/ata.h>
+#include <linux/atomic.h>
 #include <linux/bits.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/glob.h>
 #include <linux/hwmon.h>
+#include <linux/jhash.h>
+#include <linux/jiffies.h>
 #include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/overflow.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/sched/isolation.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include <asm/unaligned.h>
 #include <scsi/scsi_cmnd.h>
+#include <scsi/scsi_common.h>
 #include <scsi/scsi_device.h>
 #include <scsi/scsi_driver.h>
+#include <scsi/scsi_host.h>
 #include <scsi/scsi_proto.h>
+#include <scsi/scsi_transport.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#include <linux/io_uring.h>
+#define DRIVETEMP_URING_CMD
+#endif
+
+#include "drivetemp.h"
+
+struct drivetemp_quiesce {
+	bool active;			/* no commands are issued */
+	bool expires;			/* quiesce ends at until */
+	unsigned long until;		/* end of quiesce, jiffies */
+};
+
+#define DRIVETEMP_HISTORY	32
+
+struct drivetemp_history {
+	unsigned long time;		/* time of sample, jiffies */
+	long temp;			/* temperature */
+};
 
 struct drivetemp_data {
 	struct list_head list;		/* list of instantiated devices */
-	struct mutex lock;		/* protect data buffer accesses */
+	struct mutex lock;		/* serialize commands and data buffer */
+	spinlock_t data_lock;		/* protect sampled values and limits */
 	struct scsi_device *sdev;	/* SCSI device */
 	struct device *dev;		/* instantiating device */
 	struct device *hwdev;		/* hardware monitoring device */
-	u8 smartdata[ATA_SECT_SIZE];	/* local buffer */
+	unsigned int hwmon_id;		/* index of hwmon device */
+	u32 vpd_id;			/* hash of ATA information VPD page */
+	struct work_struct rescan_work;	/* re-identify after device rescan */
+	struct dentry *debugfs;		/* per-device debugfs directory */
+	struct kref kref;		/* lifetime, see drivetemp_release() */
+	bool removing;			/* removal started, cancel commands */
+	struct work_struct sample_work;	/* background refresh */
+	struct mutex read_lock;		/* serialize reads from drivetemp_wq */
+	struct work_struct read_work;	/* read from drivetemp_wq */
+	wait_queue_head_t read_wait;	/* wait for read_work or removal */
+	bool read_done;			/* read_work completed */
+	u32 read_attr;			/* attribute read by read_work */
+	long read_val;			/* result of read_work */
+	int read_err;
+	u8 *smartdata;			/* DMA buffer, DRIVETEMP_BUF_SIZE */
+	u8 sense[SCSI_SENSE_BUFFERSIZE]; /* sense data of last command */
+	struct scsi_sense_hdr sshdr;	/* decoded sense data */
 	int (*get_temp)(struct drivetemp_data *st, u32 attr, long *val);
 	bool have_temp_lowest;		/* lowest temp in SCT status */
 	bool have_temp_highest;		/* highest temp in SCT status */
@@ -122,160 +200,1618 @@ struct drivetemp_data {
 	bool have_temp_max;		/* have max temp */
 	bool have_temp_lcrit;		/* have lower critical limit */
 	bool have_temp_crit;		/* have critical limit */
+	bool have_temp_alarm;		/* have temperature alarm */
+	bool temp_alarm;		/* temperature alarm */
+	bool unsupported;		/* get_temp failed permanently */
+	struct drivetemp_quiesce quiesce; /* per-device quiesce state */
+	bool valid_lowest;		/* temp_lowest holds a sample */
+	bool valid_highest;		/* temp_highest holds a sample */
+	long temp_lowest;		/* last read lowest temperature */
+	long temp_highest;		/* last read highest temperature */
+	struct drivetemp_history history[DRIVETEMP_HISTORY]; /* samples */
+	unsigned int history_len;	/* number of valid history entries */
+	unsigned int history_head;	/* next history entry to write */
+	struct drivetemp_history sct_history[DRIVETEMP_HISTORY]; /* SCT table */
+	unsigned int sct_history_len;	/* entries, newest first */
+	u8 ie_asc;			/* last informational exception */
+	u8 ie_ascq;
+	char cache_key[32];		/* probe cache key, WWN or serial/fw */
 	int temp_min;			/* min temp */
 	int temp_max;			/* max temp */
 	int temp_lcrit;			/* lower critical limit */
 	int temp_crit;			/* critical limit */
+	unsigned int update_interval;	/* background refresh interval, ms */
+	unsigned long next_update;	/* next background refresh, jiffies */
+	unsigned long last_updated;	/* time of last sample, jiffies */
+	bool valid;			/* temp_input holds a sample */
+	long temp_input;		/* last sampled temperature */
+	u64 svc_ns;			/* service time since last sample */
+	u64 svc_avg_ns;			/* average service time per sample */
+	unsigned int min_interval;	/* minimum interval to meet duty cycle */
+};
+
+/*
+ * Size of the per-device data buffer. The buffer is allocated separately
+ * from struct drivetemp_data, so it does not share cache lines with data
+ * accessed by the CPU while a command is in progress, and is reused for
+ * all commands. It is large enough to fetch several log pages with a
+ * single command.
+ */
+#define DRIVETEMP_MAX_SECTORS	8
+#define DRIVETEMP_BUF_SIZE	(DRIVETEMP_MAX_SECTORS * ATA_SECT_SIZE)
+
+#define DRIVETEMP_RETRIES	5
+
+static LIST_HEAD(drivetemp_devlist);
+static DEFINE_MUTEX(drivetemp_list_lock);	/* protect drivetemp_devlist */
+static DEFINE_XARRAY(drivetemp_devs);		/* devices by hwmon index */
+
+/*
+ * All commands, including those identifying a drive at probe time, are
+ * executed from a dedicated unbound workqueue, never from the context of a
+ * reading or SCSI scanning task. Its cpumask can be configured through
+ * /sys/devices/virtual/workqueue/drivetemp/cpumask, and its timers are
+ * kept on housekeeping CPUs, so monitoring does not disturb isolated CPUs.
+ */
+static struct workqueue_struct *drivetemp_wq;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+#define DRIVETEMP_HK_TIMER	HK_TYPE_TIMER
+#else
+#define DRIVETEMP_HK_TIMER	HK_FLAG_TIMER
+#endif
+
+static unsigned int wq_max_active;
+module_param(wq_max_active, uint, 0444);
+MODULE_PARM_DESC(wq_max_active,
+		 "Maximum number of concurrently executing drivetemp work items, 0 for default (default 0)");
+
+static void drivetemp_refresh(struct work_struct *work);
+static DECLARE_DEFERRABLE_WORK(drivetemp_refresh_work, drivetemp_refresh);
+
+/*
+ * drivetemp_remove() drops the initial reference after unregistering the
+ * hwmon device. Anything executing commands outside of sysfs callbacks
+ * holds its own reference, so removal never waits for a command to finish.
+ */
+static void drivetemp_release(struct kref *kref)
+{
+	struct drivetemp_data *st = container_of(kref, struct drivetemp_data,
+						 kref);
+
+	put_device(&st->sdev->sdev_gendev);
+	kfree(st->smartdata);
+	kfree(st);
+}
+
+static void drivetemp_put(struct drivetemp_data *st)
+{
+	kref_put(&st->kref, drivetemp_release);
+}
+
+/* Queue work of st on drivetemp_wq, holding a reference until it has run */
+static void drivetemp_queue(struct drivetemp_data *st, struct work_struct *work)
+{
+	kref_get(&st->kref);
+	if (!queue_work(drivetemp_wq, work))
+		drivetemp_put(st);
+}
+
+/*
+ * Commands to a device which is being removed would only time out, so they
+ * are cancelled before being issued.
+ */
+static bool drivetemp_gone(struct drivetemp_data *st)
+{
+	struct scsi_device *sdev = st->sdev;
+
+	return READ_ONCE(st->removing) || !scsi_device_online(sdev) ||
+	       sdev->sdev_state == SDEV_CANCEL || sdev->sdev_state == SDEV_DEL;
+}
+
+static unsigned int update_interval;
+module_param(update_interval, uint, 0644);
+MODULE_PARM_DESC(update_interval,
+		 "Default background refresh interval in ms, 0 to disable (default 0)");
+
+static unsigned int duty_cycle_ppm;
+module_param(duty_cycle_ppm, uint, 0644);
+MODULE_PARM_DESC(duty_cycle_ppm,
+		 "Maximum fraction of time spent executing monitoring commands per drive, in parts per million, 0 for no limit (default 0)");
+
+static char *skip_transports;
+module_param(skip_transports, charp, 0444);
+MODULE_PARM_DESC(skip_transports,
+		 "Comma separated list of SCSI transport classes to ignore, such as iscsi_host or fc_host");
+
+static char *skip_hosts;
+module_param(skip_hosts, charp, 0444);
+MODULE_PARM_DESC(skip_hosts,
+		 "Comma separated list of SCSI host drivers to ignore, such as virtio_scsi");
+
+static char *skip_models;
+module_param(skip_models, charp, 0444);
+MODULE_PARM_DESC(skip_models,
+		 "Comma separated list of vendor:model glob patterns of drives to ignore");
+
+static unsigned int skip_host_nos[16];
+static int num_skip_host_nos;
+module_param_array_named(skip_host_nos, skip_host_nos, uint,
+			 &num_skip_host_nos, 0444);
+MODULE_PARM_DESC(skip_host_nos, "List of SCSI host numbers to ignore");
+
+/*
+ * Quiesce control. While a drive is quiesced, either by its quiesce
+ * attribute or globally by the quiesce module parameter, no monitoring
+ * commands are sent to it, and reads return the last sampled values.
+ * Both take a number of seconds after which monitoring resumes
+ * automatically, -1 to quiesce until explicitly resumed, or 0 to resume.
+ */
+static struct drivetemp_quiesce drivetemp_quiesce_all;
+static DEFINE_SPINLOCK(drivetemp_quiesce_lock);	/* protect quiesce state */
+
+static bool drivetemp_quiesce_active(const struct drivetemp_quiesce *q)
+{
+	return q->active && (!q->expires || time_before(jiffies, q->until));
+}
+
+static void drivetemp_quiesce_set(struct drivetemp_quiesce *q, long secs)
+{
+	spin_lock(&drivetemp_quiesce_lock);
+	q->active = secs != 0;
+	q->expires = secs > 0;
+	if (secs > 0)
+		q->until = jiffies + secs * HZ;
+	spin_unlock(&drivetemp_quiesce_lock);
+}
+
+/* Remaining quiesce time in seconds, -1 if indefinite */
+static long drivetemp_quiesce_get(const struct drivetemp_quiesce *q)
+{
+	long ret = 0;
+
+	spin_lock(&drivetemp_quiesce_lock);
+	if (drivetemp_quiesce_active(q))
+		ret = q->expires ? DIV_ROUND_UP(q->until - jiffies, HZ) : -1;
+	spin_unlock(&drivetemp_quiesce_lock);
+
+	return ret;
+}
+
+static bool drivetemp_quiesced(struct drivetemp_data *st)
+{
+	bool ret;
+
+	spin_lock(&drivetemp_quiesce_lock);
+	ret = drivetemp_quiesce_active(&drivetemp_quiesce_all) ||
+	      drivetemp_quiesce_active(&st->quiesce);
+	spin_unlock(&drivetemp_quiesce_lock);
+
+	return ret;
+}
+
+static int drivetemp_quiesce_param_set(const char *val,
+				       const struct kernel_param *kp)
+{
+	long secs;
+	int err;
+
+	err = kstrtol(val, 10, &secs);
+	if (err)
+		return err;
+	if (secs < -1 || secs > INT_MAX / HZ)
+		return -EINVAL;
+
+	drivetemp_quiesce_set(&drivetemp_quiesce_all, secs);
+	return 0;
+}
+
+static int drivetemp_quiesce_param_get(char *buffer,
+				       const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%ld\n",
+		       drivetemp_quiesce_get(&drivetemp_quiesce_all));
+}
+
+static const struct kernel_param_ops drivetemp_quiesce_ops = {
+	.set = drivetemp_quiesce_param_set,
+	.get = drivetemp_quiesce_param_get,
+};
+
+module_param_cb(quiesce, &drivetemp_quiesce_ops, NULL, 0644);
+MODULE_PARM_DESC(quiesce,
+		 "Stop monitoring all drives for this many seconds, -1 until resumed, 0 to resume");
+
+static unsigned int refresh_slot = 1000;
+module_param(refresh_slot, uint, 0644);
+MODULE_PARM_DESC(refresh_slot,
+		 "Length of background refresh time slots in ms (default 1000)");
+
+#define ATA_MAX_SMART_ATTRS	30
+#define SMART_TEMP_PROP_190	190
+#define SMART_TEMP_PROP_194	194
+
+#define SCT_STATUS_REQ_ADDR	0xe0
+#define  SCT_STATUS_VERSION_LOW		0	/* log byte offsets */
+#define  SCT_STATUS_VERSION_HIGH	1
+#define  SCT_STATUS_TEMP		200
+#define  SCT_STATUS_TEMP_LOWEST		201
+#define  SCT_STATUS_TEMP_HIGHEST	202
+#define SCT_READ_LOG_ADDR	0xe1
+#define  SCT_HIST_VERSION		0	/* log byte offsets */
+#define  SCT_HIST_INTERVAL		4
+#define  SCT_HIST_CB_SIZE		30
+#define  SCT_HIST_CB_INDEX		32
+#define  SCT_HIST_CB			34
+#define  SMART_READ_LOG			0xd5
+#define  SMART_WRITE_LOG		0xd6
+
+#define DEVSTAT_LOG		0x04
+#define  DEVSTAT_PAGE_LIST		0x00
+#define  DEVSTAT_PAGE_TEMP		0x05
+#define  DEVSTAT_PAGE_NUMBER		2	/* log byte offsets */
+#define  DEVSTAT_LIST_COUNT		8
+#define  DEVSTAT_LIST_ENTRIES		9
+#define  DEVSTAT_TEMP_CURRENT		8
+#define  DEVSTAT_TEMP_MAX_OP		88
+#define  DEVSTAT_TEMP_MIN_OP		104
+#define DEVSTAT_FLAGS		7	/* statistic byte offset */
+#define  DEVSTAT_SUPPORTED		BIT(7)
+#define  DEVSTAT_VALID			BIT(6)
+
+#define LOG_PAGE_SUPPORTED	0x00
+#define LOG_PAGE_IE		0x2f
+#define  LOG_IE_PARAM_LEN		7	/* log byte offsets */
+#define  LOG_IE_ASC			8
+#define  LOG_IE_ASCQ			9
+#define  LOG_IE_TEMP			10
+#define LOG_PC_CUMULATIVE	(1 << 6)
+
+#define IE_ASC_WARNING		0x0b
+#define  IE_ASCQ_TEMP_EXCEEDED		0x01
+
+#define INVALID_TEMP		0x80
+#define INVALID_LOG_TEMP	0xff
+
+#define temp_is_valid(temp)	((temp) != INVALID_TEMP)
+#define temp_from_sct(temp)	(((s8)(temp)) * 1000)
+
+#define devstat_is_valid(stat)	\
+	(((stat)[DEVSTAT_FLAGS] & (DEVSTAT_SUPPORTED | DEVSTAT_VALID)) == \
+	 (DEVSTAT_SUPPORTED | DEVSTAT_VALID))
+#define temp_from_devstat(stat)	(((s8)(stat)[0]) * 1000)
+
+static inline bool ata_id_smart_supported(u16 *id)
+{
+	return id[ATA_ID_COMMAND_SET_1] & BIT(0);
+}
+
+static inline bool ata_id_smart_enabled(u16 *id)
+{
+	return id[ATA_ID_CFS_ENABLE_1] & BIT(0);
+}
+
+static inline bool ata_id_gpl_supported(u16 *id)
+{
+	return id[ATA_ID_CSFO] & BIT(5);
+}
+
+/* Must be called with st->data_lock held once the device is registered */
+static void drivetemp_history_add(struct drivetemp_data *st,
+				  unsigned long time, long temp)
+{
+	st->history[st->history_head].time = time;
+	st->history[st->history_head].temp = temp;
+	st->history_head = (st->history_head + 1) % DRIVETEMP_HISTORY;
+	if (st->history_len < DRIVETEMP_HISTORY)
+		st->history_len++;
+}
+
+/*
+ * Keep the most recent entries of the SCT temperature history table, so
+ * the thermal behavior of the drive before probe is known. The window is
+ * kept apart from the live samples, so polling does not push it out. The
+ * table is a circular buffer of temperatures, one entry per logging
+ * interval, with the most recent entry at the index reported in the table.
+ */
+static void drivetemp_history_seed(struct drivetemp_data *st, const u8 *buf)
+{
+	unsigned int interval, size, index, count, i;
+	struct drivetemp_history *h;
+	unsigned long now = jiffies;
+	u64 age;
+	u8 temp;
+
+	interval = get_unaligned_le16(&buf[SCT_HIST_INTERVAL]);
+	size = get_unaligned_le16(&buf[SCT_HIST_CB_SIZE]);
+	index = get_unaligned_le16(&buf[SCT_HIST_CB_INDEX]);
+
+	if (get_unaligned_le16(&buf[SCT_HIST_VERSION]) != 2 || !interval ||
+	    !size || size > ATA_SECT_SIZE - SCT_HIST_CB || index >= size)
+		return;
+
+	count = min(size, (unsigned int)DRIVETEMP_HISTORY);
+	st->sct_history_len = 0;
+	for (i = 0; i < count; i++) {
+		temp = buf[SCT_HIST_CB + (index + size - i) % size];
+		if (!temp_is_valid(temp))
+			continue;
+		/* interval is in minutes, up to 65535 */
+		age = min_t(u64, (u64)i * interval * 60 * HZ,
+			    MAX_JIFFY_OFFSET);
+		h = &st->sct_history[st->sct_history_len++];
+		h->time = now - (unsigned long)age;
+		h->temp = temp_from_sct(temp);
+	}
+}
+
+/*
+ * Return the ATA error register reported for an ATA PASS-THROUGH command,
+ * either in the ATA Status Return sense descriptor or, for fixed format
+ * sense data, in the INFORMATION field. Returns -ENODATA if not available.
+ */
+static int drivetemp_ata_error(struct drivetemp_data *st)
+{
+	const u8 *sense = st->sense;
+	const u8 *desc;
+
+	switch (st->sshdr.response_code) {
+	case 0x70:
+	case 0x71:
+		/* INFORMATION field valid */
+		if (!(sense[0] & 0x80))
+			return -ENODATA;
+		return sense[3];
+	case 0x72:
+	case 0x73:
+		desc = scsi_sense_desc_find(sense, SCSI_SENSE_BUFFERSIZE, 0x09);
+		if (!desc || desc[1] < 0x0c)
+			return -ENODATA;
+		return desc[3];
+	default:
+		return -ENODATA;
+	}
+}
+
+/*
+ * Classify the result of a command.
+ *
+ * Returns 0 on success, -EOPNOTSUPP if the drive rejected the command
+ * and retrying it is pointless, -EAGAIN for transient errors which are
+ * worth an immediate retry, -EBUSY if the drive is not ready and the
+ * command should be tried again later, and another negative error code
+ * for all other errors.
+ */
+static int drivetemp_classify(struct drivetemp_data *st, const u8 *scsi_cmd,
+			      int result)
+{
+	struct scsi_sense_hdr *sshdr = &st->sshdr;
+	int ata_err;
+
+	if (!result)
+		return 0;
+
+	if (scsi_sense_valid(sshdr)) {
+		switch (sshdr->sense_key) {
+		case RECOVERED_ERROR:
+			/* includes "ATA pass through information available" */
+			return 0;
+		case ILLEGAL_REQUEST:
+			return -EOPNOTSUPP;
+		case ABORTED_COMMAND:
+			if (scsi_cmd[0] != ATA_16 || sshdr->asc || sshdr->ascq)
+				return -EAGAIN;
+			/*
+			 * For ATA pass-through, ASC/ASCQ 00h/00h reports that
+			 * the drive aborted the ATA command (ABRT), typically
+			 * because it is not supported, but is also used for
+			 * ATA errors without a better translation. Only treat
+			 * the command as unsupported if the error register
+			 * says so.
+			 */
+			ata_err = drivetemp_ata_error(st);
+			if (ata_err < 0)
+				return -EIO;
+			if (ata_err & ATA_ICRC)
+				return -EAGAIN;
+			if (ata_err & ATA_ABORTED)
+				return -EOPNOTSUPP;
+			return -EIO;
+		case UNIT_ATTENTION:
+			return -EAGAIN;
+		case NOT_READY:
+			return -EBUSY;
+		default:
+			return -EIO;
+		}
+	}
+
+	switch (host_byte(result)) {
+	case DID_OK:
+		break;
+	case DID_NO_CONNECT:
+	case DID_BAD_TARGET:
+		return -ENODEV;
+	case DID_BUS_BUSY:
+	case DID_TIME_OUT:
+	case DID_SOFT_ERROR:
+	case DID_IMM_RETRY:
+	case DID_REQUEUE:
+		return -EAGAIN;
+	default:
+		return -EIO;
+	}
+
+	switch (result & 0xff) {
+	case SAM_STAT_BUSY:
+	case SAM_STAT_TASK_SET_FULL:
+		return -EBUSY;
+	default:
+		return -EIO;
+	}
+}
+
+/*
+ * Command capture and replay, for reproducing the behavior of drives which
+ * are not locally available.
+ *
+ * If the capture module parameter is set, each command is recorded with
+ * its result, sense data, latency and data buffer. Records can be read
+ * from the trace file in the drivetemp debugfs directory, one per line:
+ *	device cdb result sense latency_us data
+ * where device is the SCSI address of the drive, result is the decimal
+ * return value of scsi_execute(), cdb, sense and data are hex strings, and
+ * sense and data are '-' if empty. Writing to the trace file clears it.
+ *
+ * Records written to the replay file are served instead of executing
+ * commands if the replay module parameter is set, with the recorded
+ * latency. A record matches a command with identical cdb sent to the
+ * recorded device, or to any device if the device is '*'. Records for the
+ * same command are served in order, then repeated. Records are validated
+ * as they are written; a write containing a bad record fails with -EINVAL,
+ * and the previously loaded records are kept.
+ */
+struct drivetemp_trace_rec {
+	struct list_head list;
+	char dev[16];
+	u8 cdb[16];
+	int result;
+	u8 sense[SCSI_SENSE_BUFFERSIZE];
+	unsigned int sense_len;
+	u32 latency_us;
+	bool used;
+	unsigned int len;
+	u8 data[];
+};
+
+static bool capture;
+module_param(capture, bool, 0644);
+MODULE_PARM_DESC(capture, "Record all commands for replay (default false)");
+
+static unsigned int capture_max = 1024;
+module_param(capture_max, uint, 0644);
+MODULE_PARM_DESC(capture_max,
+		 "Maximum number of recorded commands (default 1024)");
+
+static bool replay;
+module_param(replay, bool, 0644);
+MODULE_PARM_DESC(replay,
+		 "Serve commands from recorded responses (default false)");
+
+static LIST_HEAD(drivetemp_capture_list);
+static unsigned int drivetemp_capture_count;
+static DEFINE_MUTEX(drivetemp_capture_lock);	/* protect capture list */
+
+static LIST_HEAD(drivetemp_replay_list);
+static DEFINE_MUTEX(drivetemp_replay_lock);	/* protect replay list */
+
+#define DRIVETEMP_REPLAY_MAX	(16 * 1024 * 1024)
+#define DRIVETEMP_REPLAY_LINE	\
+	(2 * (DRIVETEMP_BUF_SIZE + SCSI_SENSE_BUFFERSIZE) + 128)
+
+static struct dentry *drivetemp_debugfs;
+
+struct drivetemp_replay_buf {
+	struct list_head records;	/* records parsed so far */
+	unsigned int count;		/* number of parsed records */
+	size_t total;			/* bytes written */
+	int err;			/* first error, if any */
+	size_t len;			/* length of incomplete line */
+	char line[DRIVETEMP_REPLAY_LINE + 1];
+};
+
+static void drivetemp_trace_free(struct list_head *head)
+{
+	struct drivetemp_trace_rec *rec, *tmp;
+
+	list_for_each_entry_safe(rec, tmp, head, list) {
+		list_del(&rec->list);
+		kfree(rec);
+	}
+}
+
+static void drivetemp_capture_cmd(struct drivetemp_data *st, const u8 *scsi_cmd,
+				  unsigned int len, int result, s64 latency_ns)
+{
+	struct drivetemp_trace_rec *rec;
+
+	rec = kzalloc(struct_size(rec, data, len), GFP_KERNEL);
+	if (!rec)
+		return;
+
+	strscpy(rec->dev, dev_name(&st->sdev->sdev_gendev), sizeof(rec->dev));
+	memcpy(rec->cdb, scsi_cmd, COMMAND_SIZE(scsi_cmd[0]));
+	rec->result = result;
+	if (scsi_sense_valid(&st->sshdr)) {
+		/* Fixed and descriptor format share the length field */
+		rec->sense_len = min(8 + st->sense[7], SCSI_SENSE_BUFFERSIZE);
+		memcpy(rec->sense, st->sense, rec->sense_len);
+	}
+	rec->latency_us = div_s64(latency_ns, NSEC_PER_USEC);
+	rec->len = len;
+	memcpy(rec->data, st->smartdata, len);
+
+	mutex_lock(&drivetemp_capture_lock);
+	list_add_tail(&rec->list, &drivetemp_capture_list);
+	drivetemp_capture_count++;
+	/* capture_max may have been lowered since the last insert */
+	while (drivetemp_capture_count > READ_ONCE(capture_max)) {
+		rec = list_first_entry(&drivetemp_capture_list,
+				       struct drivetemp_trace_rec, list);
+		list_del(&rec->list);
+		kfree(rec);
+		drivetemp_capture_count--;
+	}
+	mutex_unlock(&drivetemp_capture_lock);
+}
+
+static bool drivetemp_replay_match(struct drivetemp_trace_rec *rec,
+				   const char *dev, const u8 *scsi_cmd)
+{
+	return (!strcmp(rec->dev, "*") || !strcmp(rec->dev, dev)) &&
+		!memcmp(rec->cdb, scsi_cmd, COMMAND_SIZE(scsi_cmd[0]));
+}
+
+static int drivetemp_replay_cmd(struct drivetemp_data *st, const u8 *scsi_cmd,
+				int data_dir, unsigned int len)
+{
+	const char *dev = dev_name(&st->sdev->sdev_gendev);
+	struct drivetemp_trace_rec *rec, *found = NULL;
+	u32 latency_us;
+	int result;
+
+	mutex_lock(&drivetemp_replay_lock);
+	list_for_each_entry(rec, &drivetemp_replay_list, list) {
+		if (!drivetemp_replay_match(rec, dev, scsi_cmd))
+			continue;
+		if (!rec->used) {
+			found = rec;
+			break;
+		}
+		if (!found)
+			found = rec;
+	}
+	if (!found) {
+		mutex_unlock(&drivetemp_replay_lock);
+		return DID_NO_CONNECT << 16;
+	}
+	if (found->used) {
+		/* All records used, start over */
+		list_for_each_entry(rec, &drivetemp_replay_list, list) {
+			if (drivetemp_replay_match(rec, dev, scsi_cmd))
+				rec->used = false;
+		}
+	}
+	found->used = true;
+
+	if (data_dir == DMA_FROM_DEVICE) {
+		memset(st->smartdata, 0, len);
+		memcpy(st->smartdata, found->data, min(len, found->len));
+	}
+	if (found->result && found->sense_len) {
+		memcpy(st->sense, found->sense, found->sense_len);
+		scsi_normalize_sense(st->sense, found->sense_len, &st->sshdr);
+	}
+	result = found->result;
+	latency_us = found->latency_us;
+	mutex_unlock(&drivetemp_replay_lock);
+
+	if (latency_us > 20000)
+		msleep(latency_us / 1000);
+	else if (latency_us)
+		usleep_range(latency_us, latency_us + latency_us / 8 + 1);
+
+	return result;
+}
+
+/* Execute a single command, or replay it, and capture it if enabled */
+static int drivetemp_execute_one(struct drivetemp_data *st, const u8 *scsi_cmd,
+				 int data_dir, unsigned int len)
+{
+	ktime_t start = ktime_get();
+	int result;
+
+	memset(st->sense, 0, sizeof(st->sense));
+	memset(&st->sshdr, 0, sizeof(st->sshdr));
+	if (READ_ONCE(replay))
+		result = drivetemp_replay_cmd(st, scsi_cmd, data_dir, len);
+	else
+		result = scsi_execute(st->sdev, scsi_cmd, data_dir,
+				      st->smartdata, len, st->sense,
+				      &st->sshdr, HZ, 0, 0, 0, NULL);
+
+	if (READ_ONCE(capture))
+		drivetemp_capture_cmd(st, scsi_cmd, len, result,
+				      ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	return result;
+}
+
+static void *drivetemp_trace_start(struct seq_file *s, loff_t *pos)
+{
+	mutex_lock(&drivetemp_capture_lock);
+	return seq_list_start(&drivetemp_capture_list, *pos);
+}
+
+static void *drivetemp_trace_next(struct seq_file *s, void *v, loff_t *pos)
+{
+	return seq_list_next(v, &drivetemp_capture_list, pos);
+}
+
+static void drivetemp_trace_stop(struct seq_file *s, void *v)
+{
+	mutex_unlock(&drivetemp_capture_lock);
+}
+
+static int drivetemp_trace_show(struct seq_file *s, void *v)
+{
+	struct drivetemp_trace_rec *rec =
+			list_entry(v, struct drivetemp_trace_rec, list);
+	unsigned int i;
+
+	seq_printf(s, "%s %*phN %d ", rec->dev, (int)sizeof(rec->cdb),
+		   rec->cdb, rec->result);
+	/* %*phN prints at most 64 bytes */
+	if (!rec->sense_len)
+		seq_putc(s, '-');
+	for (i = 0; i < rec->sense_len; i += 64)
+		seq_printf(s, "%*phN", min(rec->sense_len - i, 64U),
+			   rec->sense + i);
+	seq_printf(s, " %u ", rec->latency_us);
+	if (!rec->len)
+		seq_putc(s, '-');
+	for (i = 0; i < rec->len; i += 64)
+		seq_printf(s, "%*phN", min(rec->len - i, 64U), rec->data + i);
+	seq_putc(s, '\n');
+	return 0;
+}
+
+static const struct seq_operations drivetemp_trace_seq_ops = {
+	.start = drivetemp_trace_start,
+	.next = drivetemp_trace_next,
+	.stop = drivetemp_trace_stop,
+	.show = drivetemp_trace_show,
+};
+
+static int drivetemp_trace_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &drivetemp_trace_seq_ops);
+}
+
+static ssize_t drivetemp_trace_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	mutex_lock(&drivetemp_capture_lock);
+	drivetemp_trace_free(&drivetemp_capture_list);
+	drivetemp_capture_count = 0;
+	mutex_unlock(&drivetemp_capture_lock);
+	return count;
+}
+
+static const struct file_operations drivetemp_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = drivetemp_trace_open,
+	.read = seq_read,
+	.write = drivetemp_trace_write,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
+
+static struct drivetemp_trace_rec *drivetemp_replay_parse(char *line)
+{
+	char *fields[6];
+	struct drivetemp_trace_rec *rec;
+	unsigned int len, sense_len;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		fields[i] = strsep(&line, " ");
+		if (!fields[i])
+			return ERR_PTR(-EINVAL);
+	}
+
+	if (line)
+		return ERR_PTR(-EINVAL);
+
+	len = strcmp(fields[5], "-") ? strlen(fields[5]) : 0;
+	if (len % 2 || len / 2 > DRIVETEMP_BUF_SIZE)
+		return ERR_PTR(-EINVAL);
+	len /= 2;
+
+	sense_len = strcmp(fields[3], "-") ? strlen(fields[3]) : 0;
+	if (sense_len % 2 || sense_len / 2 > SCSI_SENSE_BUFFERSIZE)
+		return ERR_PTR(-EINVAL);
+	sense_len /= 2;
+
+	rec = kzalloc(struct_size(rec, data, len), GFP_KERNEL);
+	if (!rec)
+		return ERR_PTR(-ENOMEM);
+
+	rec->len = len;
+	rec->sense_len = sense_len;
+	if (strscpy(rec->dev, fields[0], sizeof(rec->dev)) < 0 ||
+	    strlen(fields[1]) != 2 * sizeof(rec->cdb) ||
+	    hex2bin(rec->cdb, fields[1], sizeof(rec->cdb)) ||
+	    kstrtoint(fields[2], 10, &rec->result) ||
+	    (sense_len && hex2bin(rec->sense, fields[3], sense_len)) ||
+	    kstrtou32(fields[4], 10, &rec->latency_us) ||
+	    (len && hex2bin(rec->data, fields[5], len))) {
+		kfree(rec);
+		return ERR_PTR(-EINVAL);
+	}
+	return rec;
+}
+
+/*
+ * Replay records are parsed line by line as they are written, and replace
+ * the loaded records when the file is closed without error.
+ */
+static int drivetemp_replay_open(struct inode *inode, struct file *file)
+{
+	struct drivetemp_replay_buf *rb;
+
+	rb = kvzalloc(sizeof(*rb), GFP_KERNEL);
+	if (!rb)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&rb->records);
+	file->private_data = rb;
+	return 0;
+}
+
+static int drivetemp_replay_add(struct drivetemp_replay_buf *rb, char *line)
+{
+	struct drivetemp_trace_rec *rec;
+
+	line = strim(line);
+	if (!*line)
+		return 0;
+
+	rec = drivetemp_replay_parse(line);
+	if (IS_ERR(rec)) {
+		pr_warn("drivetemp: bad replay record %u\n", rb->count + 1);
+		return PTR_ERR(rec);
+	}
+	list_add_tail(&rec->list, &rb->records);
+	rb->count++;
+	return 0;
+}
+
+static ssize_t drivetemp_replay_write(struct file *file, const char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct drivetemp_replay_buf *rb = file->private_data;
+	size_t done = 0, chunk, used;
+	char *nl;
+	int err;
+
+	if (rb->err)
+		return rb->err;
+	if (rb->total + count > DRIVETEMP_REPLAY_MAX)
+		return -EFBIG;
+
+	while (done < count) {
+		chunk = min(count - done, DRIVETEMP_REPLAY_LINE - rb->len);
+		if (!chunk) {
+			/* line too long */
+			err = -EINVAL;
+			goto fail;
+		}
+		if (copy_from_user(rb->line + rb->len, buf + done, chunk)) {
+			err = -EFAULT;
+			goto fail;
+		}
+		rb->len += chunk;
+		done += chunk;
+
+		while ((nl = memchr(rb->line, '\n', rb->len))) {
+			*nl = '\0';
+			err = drivetemp_replay_add(rb, rb->line);
+			if (err)
+				goto fail;
+			used = nl + 1 - rb->line;
+			rb->len -= used;
+			memmove(rb->line, nl + 1, rb->len);
+		}
+	}
+
+	rb->total += count;
+	*ppos += count;
+	return count;
+
+fail:
+	rb->err = err;
+	return err;
+}
+
+/* Parse a final line without newline, and report errors to close() */
+static int drivetemp_replay_flush(struct file *file, fl_owner_t id)
+{
+	struct drivetemp_replay_buf *rb = file->private_data;
+
+	if (!rb->err && rb->len) {
+		rb->line[rb->len] = '\0';
+		rb->err = drivetemp_replay_add(rb, rb->line);
+		rb->len = 0;
+	}
+	return rb->err;
+}
+
+static int drivetemp_replay_release(struct inode *inode, struct file *file)
+{
+	struct drivetemp_replay_buf *rb = file->private_data;
+
+	/* Keep the loaded records if the file was not written to */
+	if (!rb->err && rb->total) {
+		mutex_lock(&drivetemp_replay_lock);
+		drivetemp_trace_free(&drivetemp_replay_list);
+		list_splice_init(&rb->records, &drivetemp_replay_list);
+		mutex_unlock(&drivetemp_replay_lock);
+	}
+	drivetemp_trace_free(&rb->records);
+	kvfree(rb);
+	return 0;
+}
+
+static const struct file_operations drivetemp_replay_fops = {
+	.owner = THIS_MODULE,
+	.open = drivetemp_replay_open,
+	.write = drivetemp_replay_write,
+	.flush = drivetemp_replay_flush,
+	.release = drivetemp_replay_release,
+	.llseek = no_llseek,
+};
+
+/*
+ * Execute a command using the preallocated per-device data and sense
+ * buffers. The driver itself does not allocate memory on the steady state
+ * sampling path, and the block request is taken from the preallocated tag
+ * set of the SCSI host. The path is not allocation free, though: mapping
+ * the data buffer (blk_rq_map_kern()) still allocates a bio for every
+ * command. Sense data is retained in st->sense and st->sshdr. Only
+ * transient errors are retried. Must be called with st->lock held.
+ */
+static int drivetemp_execute(struct drivetemp_data *st, const u8 *scsi_cmd,
+			     int data_dir, unsigned int len)
+{
+	int retries = DRIVETEMP_RETRIES;
+	ktime_t start = ktime_get();
+	int result;
+	int err;
+
+	do {
+		if (drivetemp_gone(st)) {
+			err = -ENODEV;
+			break;
+		}
+		result = drivetemp_execute_one(st, scsi_cmd, data_dir, len);
+		err = drivetemp_classify(st, scsi_cmd, result);
+	} while (err == -EAGAIN && --retries > 0);
+
+	st->svc_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	if (err && scsi_sense_valid(&st->sshdr))
+		dev_dbg(&st->sdev->sdev_gendev,
+			"command 0x%02x failed, sense %02x/%02x/%02x (%d)\n",
+			scsi_cmd[0], st->sshdr.sense_key, st->sshdr.asc,
+			st->sshdr.ascq, err);
+
+	return err;
+}
+
+/*
+ * Issue an ATA command through ATA PASS-THROUGH (16). The command transfers
+ * count sectors of data. If ext is set, the command is issued as 48-bit
+ * command, with 16-bit count and 48-bit lba; otherwise, lba is limited to
+ * 28 bit and count to 8 bit.
+ */
+static int drivetemp_scsi_command(struct drivetemp_data *st,
+				 u8 ata_command, u8 feature, u64 lba,
+				 unsigned int count, bool ext)
+{
+	u8 scsi_cmd[MAX_COMMAND_SIZE];
+	int data_dir;
+
+	if (!count || count > DRIVETEMP_MAX_SECTORS)
+		return -EINVAL;
+
+	memset(scsi_cmd, 0, sizeof(scsi_cmd));
+	scsi_cmd[0] = ATA_16;
+	if (ata_command == ATA_CMD_SMART && feature == SMART_WRITE_LOG) {
+		scsi_cmd[1] = (5 << 1);	/* PIO Data-out */
+		/*
+		 * No off.line or cc, write to dev, block count in sector count
+		 * field.
+		 */
+		scsi_cmd[2] = 0x06;
+		data_dir = DMA_TO_DEVICE;
+	} else {
+		scsi_cmd[1] = (4 << 1);	/* PIO Data-in */
+		/*
+		 * No off.line or cc, read from dev, block count in sector count
+		 * field.
+		 */
+		scsi_cmd[2] = 0x0e;
+		data_dir = DMA_FROM_DEVICE;
+	}
+	if (ext) {
+		scsi_cmd[1] |= 0x01;	/* extend */
+		scsi_cmd[5] = count >> 8;
+		scsi_cmd[7] = lba >> 24;
+		scsi_cmd[9] = lba >> 32;
+		scsi_cmd[11] = lba >> 40;
+	} else {
+		scsi_cmd[13] = (lba >> 24) & 0x0f;
+	}
+	scsi_cmd[4] = feature;
+	scsi_cmd[6] = count;
+	scsi_cmd[8] = lba;
+	scsi_cmd[10] = lba >> 8;
+	scsi_cmd[12] = lba >> 16;
+	scsi_cmd[14] = ata_command;
+
+	return drivetemp_execute(st, scsi_cmd, data_dir,
+				 count * ATA_SECT_SIZE);
+}
+
+static int drivetemp_ata_command(struct drivetemp_data *st, u8 feature, u8 select)
+{
+	return drivetemp_scsi_command(st, ATA_CMD_SMART, feature,
+				     select | (ATA_SMART_LBAM_PASS << 8) |
+				     (ATA_SMART_LBAH_PASS << 16), 1, false);
+}
+
+/* Read count pages of a General Purpose log, starting with page */
+static int drivetemp_read_log_ext(struct drivetemp_data *st, u8 log, u16 page,
+				  unsigned int count)
+{
+	return drivetemp_scsi_command(st, ATA_CMD_READ_LOG_EXT, 0,
+				     log | ((u64)(page & 0xff) << 8) |
+				     ((u64)(page >> 8) << 40), count, true);
+}
+
+static int drivetemp_log_sense(struct drivetemp_data *st, u8 page)
+{
+	u8 scsi_cmd[MAX_COMMAND_SIZE];
+
+	memset(scsi_cmd, 0, sizeof(scsi_cmd));
+	scsi_cmd[0] = LOG_SENSE;
+	scsi_cmd[2] = LOG_PC_CUMULATIVE | page;
+	put_unaligned_be16(DRIVETEMP_BUF_SIZE, &scsi_cmd[7]);
+
+	return drivetemp_execute(st, scsi_cmd, DMA_FROM_DEVICE,
+				 DRIVETEMP_BUF_SIZE);
+}
+
+static int drivetemp_get_smarttemp(struct drivetemp_data *st, u32 attr,
+				  long *temp)
+{
+	u8 *buf = st->smartdata;
+	bool have_temp = false;
+	u8 temp_raw;
+	u8 csum;
+	int err;
+	int i;
+
+	err = drivetemp_ata_command(st, ATA_SMART_READ_VALUES, 0);
+	if (err)
+		return err;
+
+	/* Checksum the read value table */
+	csum = 0;
+	for (i = 0; i < ATA_SECT_SIZE; i++)
+		csum += buf[i];
+	if (csum) {
+		dev_dbg(&st->sdev->sdev_gendev,
+			"checksum error reading SMART values\n");
+		return -EIO;
+	}
+
+	for (i = 0; i < ATA_MAX_SMART_ATTRS; i++) {
+		u8 *attr = buf + i * 12;
+		int id = attr[2];
+
+		if (!id)
+			continue;
+
+		if (id == SMART_TEMP_PROP_190) {
+			temp_raw = attr[7];
+			have_temp = true;
+		}
+		if (id == SMART_TEMP_PROP_194) {
+			temp_raw = attr[7];
+			have_temp = true;
+			break;
+		}
+	}
+
+	if (have_temp) {
+		*temp = temp_raw * 1000;
+		return 0;
+	}
+
+	return -ENXIO;
+}
+
+static int drivetemp_get_scttemp(struct drivetemp_data *st, u32 attr, long *val)
+{
+	u8 *buf = st->smartdata;
+	int err;
+
+	err = drivetemp_ata_command(st, SMART_READ_LOG, SCT_STATUS_REQ_ADDR);
+	if (err)
+		return err;
+
+	/* Lowest and highest temperature come with every status read */
+	spin_lock(&st->data_lock);
+	if (st->have_temp_lowest && temp_is_valid(buf[SCT_STATUS_TEMP_LOWEST])) {
+		st->temp_lowest = temp_from_sct(buf[SCT_STATUS_TEMP_LOWEST]);
+		st->valid_lowest = true;
+	}
+	if (st->have_temp_highest &&
+	    temp_is_valid(buf[SCT_STATUS_TEMP_HIGHEST])) {
+		st->temp_highest = temp_from_sct(buf[SCT_STATUS_TEMP_HIGHEST]);
+		st->valid_highest = true;
+	}
+	spin_unlock(&st->data_lock);
+
+	switch (attr) {
+	case hwmon_temp_input:
+		*val = temp_from_sct(buf[SCT_STATUS_TEMP]);
+		break;
+	case hwmon_temp_lowest:
+		*val = temp_from_sct(buf[SCT_STATUS_TEMP_LOWEST]);
+		break;
+	case hwmon_temp_highest:
+		*val = temp_from_sct(buf[SCT_STATUS_TEMP_HIGHEST]);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
+	return err;
+}
+
+static int drivetemp_get_ietemp(struct drivetemp_data *st, u32 attr, long *val)
+{
+	u8 *buf = st->smartdata;
+	u8 asc, ascq;
+	int err;
+
+	if (attr != hwmon_temp_input)
+		return -EINVAL;
+
+	err = drivetemp_log_sense(st, LOG_PAGE_IE);
+	if (err)
+		return err;
+
+	/* Parameter 0000h must include the most recent temperature reading */
+	if ((buf[0] & 0x3f) != LOG_PAGE_IE ||
+	    get_unaligned_be16(&buf[2]) < LOG_IE_TEMP - 3 ||
+	    get_unaligned_be16(&buf[4]) != 0 ||
+	    buf[LOG_IE_PARAM_LEN] < LOG_IE_TEMP - LOG_IE_PARAM_LEN)
+		return -EIO;
+
+	asc = buf[LOG_IE_ASC];
+	ascq = buf[LOG_IE_ASCQ];
+	if (asc && (asc != st->ie_asc || ascq != st->ie_ascq))
+		dev_warn(&st->sdev->sdev_gendev,
+			 "informational exception, ASC/ASCQ 0x%02x/0x%02x\n",
+			 asc, ascq);
+	st->ie_asc = asc;
+	st->ie_ascq = ascq;
+	spin_lock(&st->data_lock);
+	st->temp_alarm = asc == IE_ASC_WARNING && ascq == IE_ASCQ_TEMP_EXCEEDED;
+	spin_unlock(&st->data_lock);
+
+	if (buf[LOG_IE_TEMP] == INVALID_LOG_TEMP)
+		return -ENODATA;
+
+	*val = buf[LOG_IE_TEMP] * 1000;
+	return 0;
+}
+
+static int drivetemp_identify_ie(struct drivetemp_data *st)
+{
+	u8 *buf = st->smartdata;
+	bool have_ie = false;
+	long temp;
+	int len;
+	int err;
+	int i;
+
+	err = drivetemp_log_sense(st, LOG_PAGE_SUPPORTED);
+	if (err)
+		return -ENODEV;
+
+	if ((buf[0] & 0x3f) != LOG_PAGE_SUPPORTED)
+		return -ENODEV;
+
+	len = min_t(int, get_unaligned_be16(&buf[2]), DRIVETEMP_BUF_SIZE - 4);
+	for (i = 0; i < len; i++) {
+		if (buf[4 + i] == LOG_PAGE_IE) {
+			have_ie = true;
+			break;
+		}
+	}
+	if (!have_ie)
+		return -ENODEV;
+
+	err = drivetemp_get_ietemp(st, hwmon_temp_input, &temp);
+	if (err)
+		return -ENODEV;
+
+	st->have_temp_alarm = true;
+	st->get_temp = drivetemp_get_ietemp;
+	return 0;
+}
+
+static int drivetemp_get_devstattemp(struct drivetemp_data *st, u32 attr,
+				     long *val)
+{
+	u8 *buf = st->smartdata;
+	int err;
+
+	if (attr != hwmon_temp_input)
+		return -EINVAL;
+
+	err = drivetemp_read_log_ext(st, DEVSTAT_LOG, DEVSTAT_PAGE_TEMP, 1);
+	if (err)
+		return err;
+
+	if (buf[DEVSTAT_PAGE_NUMBER] != DEVSTAT_PAGE_TEMP)
+		return -EIO;
+	if (!devstat_is_valid(&buf[DEVSTAT_TEMP_CURRENT]))
+		return -ENODATA;
+
+	*val = temp_from_devstat(&buf[DEVSTAT_TEMP_CURRENT]);
+	return 0;
+}
+
+static int drivetemp_identify_devstat(struct drivetemp_data *st)
+{
+	u8 *buf = st->smartdata;
+	bool have_temp_page = false;
+	u8 *page;
+	int count;
+	int err;
+	int i;
+
+	/*
+	 * Read the list of supported pages and the Temperature Statistics
+	 * page, and everything in between, with a single command.
+	 */
+	err = drivetemp_read_log_ext(st, DEVSTAT_LOG, DEVSTAT_PAGE_LIST,
+				     DEVSTAT_PAGE_TEMP + 1);
+	if (err)
+		return -ENODEV;
+
+	if (buf[DEVSTAT_PAGE_NUMBER] != DEVSTAT_PAGE_LIST)
+		return -ENODEV;
+
+	count = min_t(int, buf[DEVSTAT_LIST_COUNT],
+		      ATA_SECT_SIZE - DEVSTAT_LIST_ENTRIES);
+	for (i = 0; i < count; i++) {
+		if (buf[DEVSTAT_LIST_ENTRIES + i] == DEVSTAT_PAGE_TEMP) {
+			have_temp_page = true;
+			break;
+		}
+	}
+	if (!have_temp_page)
+		return -ENODEV;
+
+	page = buf + DEVSTAT_PAGE_TEMP * ATA_SECT_SIZE;
+	if (page[DEVSTAT_PAGE_NUMBER] != DEVSTAT_PAGE_TEMP ||
+	    !devstat_is_valid(&page[DEVSTAT_TEMP_CURRENT]))
+		return -ENODEV;
+
+	st->have_temp_max = devstat_is_valid(&page[DEVSTAT_TEMP_MAX_OP]);
+	st->have_temp_min = devstat_is_valid(&page[DEVSTAT_TEMP_MIN_OP]);
+	st->temp_max = temp_from_devstat(&page[DEVSTAT_TEMP_MAX_OP]);
+	st->temp_min = temp_from_devstat(&page[DEVSTAT_TEMP_MIN_OP]);
+
+	st->get_temp = drivetemp_get_devstattemp;
+	return 0;
+}
+
+/*
+ * Probe cache. Identification results of SATA drives can be exported
+ * through the per-device probe_cache attribute and fed back on the next
+ * boot through the probe_cache module parameter, as semicolon separated
+ * list of entries. Each entry has the format
+ *	key,method,flags,max,crit,min,lcrit
+ * where key is the WWN of the drive (or its serial number if it has no
+ * WWN) and its firmware revision, flags are the supported attributes, and
+ * limits are in degrees C. If a cached entry matches a drive, its results
+ * are used instead of running the full identification, after verifying
+ * that the cached method can read the temperature.
+ */
+enum drivetemp_method {
+	DRIVETEMP_METHOD_SCT,
+	DRIVETEMP_METHOD_DEVSTAT,
+	DRIVETEMP_METHOD_SMART,
+	DRIVETEMP_METHOD_MAX,
+};
+
+static const char * const drivetemp_method_names[] = {
+	[DRIVETEMP_METHOD_SCT] = "sct",
+	[DRIVETEMP_METHOD_DEVSTAT] = "devstat",
+	[DRIVETEMP_METHOD_SMART] = "smart",
+};
+
+static int (* const drivetemp_methods[])(struct drivetemp_data *st, u32 attr,
+					 long *val) = {
+	[DRIVETEMP_METHOD_SCT] = drivetemp_get_scttemp,
+	[DRIVETEMP_METHOD_DEVSTAT] = drivetemp_get_devstattemp,
+	[DRIVETEMP_METHOD_SMART] = drivetemp_get_smarttemp,
+};
+
+#define CACHE_HAVE_LOWEST	BIT(0)
+#define CACHE_HAVE_HIGHEST	BIT(1)
+#define CACHE_HAVE_MIN		BIT(2)
+#define CACHE_HAVE_MAX		BIT(3)
+#define CACHE_HAVE_LCRIT	BIT(4)
+#define CACHE_HAVE_CRIT		BIT(5)
+
+struct drivetemp_cache_entry {
+	struct list_head list;
+	char key[32];
+	enum drivetemp_method method;
+	u8 flags;
+	int temp_max;
+	int temp_crit;
+	int temp_min;
+	int temp_lcrit;
+};
+
+static LIST_HEAD(drivetemp_cache);
+static DEFINE_MUTEX(drivetemp_cache_lock);	/* protect drivetemp_cache */
+
+static int drivetemp_cache_parse(char *str, struct drivetemp_cache_entry *e)
+{
+	char *fields[7];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(fields); i++) {
+		fields[i] = strsep(&str, ",");
+		if (!fields[i])
+			return -EINVAL;
+	}
+	if (str || strscpy(e->key, strim(fields[0]), sizeof(e->key)) <= 0)
+		return -EINVAL;
+
+	i = match_string(drivetemp_method_names, DRIVETEMP_METHOD_MAX,
+			 fields[1]);
+	if (i < 0)
+		return -EINVAL;
+	e->method = i;
+
+	if (kstrtou8(fields[2], 16, &e->flags) ||
+	    kstrtoint(fields[3], 10, &e->temp_max) ||
+	    kstrtoint(fields[4], 10, &e->temp_crit) ||
+	    kstrtoint(fields[5], 10, &e->temp_min) ||
+	    kstrtoint(fields[6], 10, &e->temp_lcrit))
+		return -EINVAL;
+
+	e->temp_max *= 1000;
+	e->temp_crit *= 1000;
+	e->temp_min *= 1000;
+	e->temp_lcrit *= 1000;
+	return 0;
+}
+
+static int drivetemp_cache_set(const char *val, const struct kernel_param *kp)
+{
+	struct drivetemp_cache_entry *e, *old;
+	char *buf, *str, *entry;
+	int err = 0;
+
+	buf = kstrdup(val, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&drivetemp_cache_lock);
+	str = buf;
+	while ((entry = strsep(&str, ";\n"))) {
+		entry = strim(entry);
+		if (!*entry)
+			continue;
+		e = kzalloc(sizeof(*e), GFP_KERNEL);
+		if (!e) {
+			err = -ENOMEM;
+			break;
+		}
+		err = drivetemp_cache_parse(entry, e);
+		if (err) {
+			kfree(e);
+			break;
+		}
+		list_for_each_entry(old, &drivetemp_cache, list) {
+			if (!strcmp(old->key, e->key)) {
+				list_del(&old->list);
+				kfree(old);
+				break;
+			}
+		}
+		list_add(&e->list, &drivetemp_cache);
+	}
+	mutex_unlock(&drivetemp_cache_lock);
+
+	kfree(buf);
+	return err;
+}
+
+static const struct kernel_param_ops drivetemp_cache_ops = {
+	.set = drivetemp_cache_set,
 };
 
-static LIST_HEAD(drivetemp_devlist);
+module_param_cb(probe_cache, &drivetemp_cache_ops, NULL, 0200);
+MODULE_PARM_DESC(probe_cache,
+		 "Cached identification results, as exported by the probe_cache attribute of each drive");
 
-#define ATA_MAX_SMART_ATTRS	30
-#define SMART_TEMP_PROP_190	190
-#define SMART_TEMP_PROP_194	194
+static void drivetemp_cache_free(void)
+{
+	struct drivetemp_cache_entry *e, *tmp;
 
-#define SCT_STATUS_REQ_ADDR	0xe0
-#define  SCT_STATUS_VERSION_LOW		0	/* log byte offsets */
-#define  SCT_STATUS_VERSION_HIGH	1
-#define  SCT_STATUS_TEMP		200
-#define  SCT_STATUS_TEMP_LOWEST		201
-#define  SCT_STATUS_TEMP_HIGHEST	202
-#define SCT_READ_LOG_ADDR	0xe1
-#define  SMART_READ_LOG			0xd5
-#define  SMART_WRITE_LOG		0xd6
+	list_for_each_entry_safe(e, tmp, &drivetemp_cache, list) {
+		list_del(&e->list);
+		kfree(e);
+	}
+}
 
-#define INVALID_TEMP		0x80
+static int drivetemp_method(struct drivetemp_data *st)
+{
+	int i;
 
-#define temp_is_valid(temp)	((temp) != INVALID_TEMP)
-#define temp_from_sct(temp)	(((s8)(temp)) * 1000)
+	for (i = 0; i < DRIVETEMP_METHOD_MAX; i++) {
+		if (st->get_temp == drivetemp_methods[i])
+			return i;
+	}
+	return -ENODATA;
+}
 
-static inline bool ata_id_smart_supported(u16 *id)
+/* Copy an ATA identify string, strip padding, and replace separators */
+static void drivetemp_id_string(const u16 *id, char *s, unsigned int ofs,
+				unsigned int len)
 {
-	return id[ATA_ID_COMMAND_SET_1] & BIT(0);
+	char *p = s;
+
+	while (len > 0) {
+		*p++ = id[ofs] >> 8;
+		*p++ = id[ofs] & 0xff;
+		ofs++;
+		len -= 2;
+	}
+	*p = '\0';
+
+	strim(s);
+	for (p = s; *p; p++) {
+		if (*p == ' ' || *p == ',' || *p == ';' || *p == '/')
+			*p = '_';
+	}
 }
 
-static inline bool ata_id_smart_enabled(u16 *id)
+static void drivetemp_cache_key(struct drivetemp_data *st, const u16 *ata_id)
 {
-	return id[ATA_ID_CFS_ENABLE_1] & BIT(0);
+	char serial[ATA_ID_SERNO_LEN + 1];
+	char fw[ATA_ID_FW_REV_LEN + 1];
+
+	drivetemp_id_string(ata_id, fw, ATA_ID_FW_REV, ATA_ID_FW_REV_LEN);
+	if (ata_id_has_wwn(ata_id)) {
+		snprintf(st->cache_key, sizeof(st->cache_key), "%016llx/%s",
+			 ((u64)ata_id[ATA_ID_WWN] << 48) |
+			 ((u64)ata_id[ATA_ID_WWN + 1] << 32) |
+			 ((u64)ata_id[ATA_ID_WWN + 2] << 16) |
+			 ata_id[ATA_ID_WWN + 3], fw);
+	} else {
+		drivetemp_id_string(ata_id, serial, ATA_ID_SERNO,
+				    ATA_ID_SERNO_LEN);
+		snprintf(st->cache_key, sizeof(st->cache_key), "%s/%s",
+			 serial, fw);
+	}
 }
 
-static int drivetemp_scsi_command(struct drivetemp_data *st,
-				 u8 ata_command, u8 feature,
-				 u8 lba_low, u8 lba_mid, u8 lba_high)
+static int drivetemp_identify_cached(struct drivetemp_data *st)
 {
-	u8 scsi_cmd[MAX_COMMAND_SIZE];
-	int data_dir;
+	struct drivetemp_cache_entry *e;
+	bool found = false;
+	long temp;
+	int err;
 
-	memset(scsi_cmd, 0, sizeof(scsi_cmd));
-	scsi_cmd[0] = ATA_16;
-	if (ata_command == ATA_CMD_SMART && feature == SMART_WRITE_LOG) {
-		scsi_cmd[1] = (5 << 1);	/* PIO Data-out */
-		/*
-		 * No off.line or cc, write to dev, block count in sector count
-		 * field.
-		 */
-		scsi_cmd[2] = 0x06;
-		data_dir = DMA_TO_DEVICE;
-	} else {
-		scsi_cmd[1] = (4 << 1);	/* PIO Data-in */
-		/*
-		 * No off.line or cc, read from dev, block count in sector count
-		 * field.
-		 */
-		scsi_cmd[2] = 0x0e;
-		data_dir = DMA_FROM_DEVICE;
+	mutex_lock(&drivetemp_cache_lock);
+	list_for_each_entry(e, &drivetemp_cache, list) {
+		if (strcmp(e->key, st->cache_key))
+			continue;
+		st->get_temp = drivetemp_methods[e->method];
+		st->have_temp_lowest = e->flags & CACHE_HAVE_LOWEST;
+		st->have_temp_highest = e->flags & CACHE_HAVE_HIGHEST;
+		st->have_temp_min = e->flags & CACHE_HAVE_MIN;
+		st->have_temp_max = e->flags & CACHE_HAVE_MAX;
+		st->have_temp_lcrit = e->flags & CACHE_HAVE_LCRIT;
+		st->have_temp_crit = e->flags & CACHE_HAVE_CRIT;
+		st->temp_max = e->temp_max;
+		st->temp_crit = e->temp_crit;
+		st->temp_min = e->temp_min;
+		st->temp_lcrit = e->temp_lcrit;
+		found = true;
+		break;
 	}
-	scsi_cmd[4] = feature;
-	scsi_cmd[6] = 1;	/* 1 sector */
-	scsi_cmd[8] = lba_low;
-	scsi_cmd[10] = lba_mid;
-	scsi_cmd[12] = lba_high;
-	scsi_cmd[14] = ata_command;
+	mutex_unlock(&drivetemp_cache_lock);
+
+	if (!found)
+		return -ENOENT;
+
+	err = st->get_temp(st, hwmon_temp_input, &temp);
+	if (err) {
+		dev_info(&st->sdev->sdev_gendev,
+			 "cached identification failed verification (%d)\n",
+			 err);
+		st->get_temp = NULL;
+		st->have_temp_lowest = false;
+		st->have_temp_highest = false;
+		st->have_temp_min = false;
+		st->have_temp_max = false;
+		st->have_temp_lcrit = false;
+		st->have_temp_crit = false;
+		st->temp_max = 0;
+		st->temp_crit = 0;
+		st->temp_min = 0;
+		st->temp_lcrit = 0;
+	}
+	return err;
+}
 
-	return scsi_execute_req(st->sdev, scsi_cmd, data_dir,
-				st->smartdata, ATA_SECT_SIZE, NULL, HZ, 5,
-				NULL);
+static ssize_t probe_cache_show(struct device *dev,
+				struct device_attribute *devattr, char *buf)
+{
+	struct drivetemp_data *st = dev_get_drvdata(dev);
+	ssize_t ret;
+	u8 flags;
+	int method;
+
+	spin_lock(&st->data_lock);
+	method = drivetemp_method(st);
+	if (method < 0 || !st->cache_key[0]) {
+		ret = -ENODATA;
+		goto unlock;
+	}
+	flags = (st->have_temp_lowest ? CACHE_HAVE_LOWEST : 0) |
+		(st->have_temp_highest ? CACHE_HAVE_HIGHEST : 0) |
+		(st->have_temp_min ? CACHE_HAVE_MIN : 0) |
+		(st->have_temp_max ? CACHE_HAVE_MAX : 0) |
+		(st->have_temp_lcrit ? CACHE_HAVE_LCRIT : 0) |
+		(st->have_temp_crit ? CACHE_HAVE_CRIT : 0);
+	ret = sprintf(buf, "%s,%s,%x,%d,%d,%d,%d\n", st->cache_key,
+		      drivetemp_method_names[method], flags,
+		      st->temp_max / 1000, st->temp_crit / 1000,
+		      st->temp_min / 1000, st->temp_lcrit / 1000);
+unlock:
+	spin_unlock(&st->data_lock);
+	return ret;
 }
 
-static int drivetemp_ata_command(struct drivetemp_data *st, u8 feature, u8 select)
+static DEVICE_ATTR_RO(probe_cache);
+
+static ssize_t quiesce_show(struct device *dev,
+			    struct device_attribute *devattr, char *buf)
 {
-	return drivetemp_scsi_command(st, ATA_CMD_SMART, feature, select,
-				     ATA_SMART_LBAM_PASS, ATA_SMART_LBAH_PASS);
+	struct drivetemp_data *st = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%ld\n", drivetemp_quiesce_get(&st->quiesce));
 }
 
-static int drivetemp_get_smarttemp(struct drivetemp_data *st, u32 attr,
-				  long *temp)
+static ssize_t quiesce_store(struct device *dev,
+			     struct device_attribute *devattr,
+			     const char *buf, size_t count)
 {
-	u8 *buf = st->smartdata;
-	bool have_temp = false;
-	u8 temp_raw;
-	u8 csum;
+	struct drivetemp_data *st = dev_get_drvdata(dev);
+	long secs;
 	int err;
-	int i;
 
-	err = drivetemp_ata_command(st, ATA_SMART_READ_VALUES, 0);
+	err = kstrtol(buf, 10, &secs);
 	if (err)
 		return err;
+	if (secs < -1 || secs > INT_MAX / HZ)
+		return -EINVAL;
 
-	/* Checksum the read value table */
-	csum = 0;
-	for (i = 0; i < ATA_SECT_SIZE; i++)
-		csum += buf[i];
-	if (csum) {
-		dev_dbg(&st->sdev->sdev_gendev,
-			"checksum error reading SMART values\n");
-		return -EIO;
-	}
+	drivetemp_quiesce_set(&st->quiesce, secs);
+	return count;
+}
 
-	for (i = 0; i < ATA_MAX_SMART_ATTRS; i++) {
-		u8 *attr = buf + i * 12;
-		int id = attr[2];
+static DEVICE_ATTR_RW(quiesce);
 
-		if (!id)
-			continue;
+/* Reported values are from the cache, since the drive is quiesced */
+static ssize_t stale_show(struct device *dev,
+			  struct device_attribute *devattr, char *buf)
+{
+	struct drivetemp_data *st = dev_get_drvdata(dev);
 
-		if (id == SMART_TEMP_PROP_190) {
-			temp_raw = attr[7];
-			have_temp = true;
-		}
-		if (id == SMART_TEMP_PROP_194) {
-			temp_raw = attr[7];
-			have_temp = true;
-			break;
-		}
-	}
+	return sprintf(buf, "%d\n", drivetemp_quiesced(st));
+}
 
-	if (have_temp) {
-		*temp = temp_raw * 1000;
-		return 0;
-	}
+static DEVICE_ATTR_RO(stale);
 
-	return -ENXIO;
-}
+static struct attribute *drivetemp_attrs[] = {
+	&dev_attr_probe_cache.attr,
+	&dev_attr_quiesce.attr,
+	&dev_attr_stale.attr,
+	NULL
+};
 
-static int drivetemp_get_scttemp(struct drivetemp_data *st, u32 attr, long *val)
+ATTRIBUTE_GROUPS(drivetemp);
+
+/*
+ * Sample window, newest first, as age in ms and temperature, reported in
+ * the history file of the per-device debugfs directory. The window read
+ * from the SCT temperature history table is reported in sct_history.
+ */
+static int drivetemp_history_show(struct seq_file *s, void *v)
 {
-	u8 *buf = st->smartdata;
-	int err;
+	struct drivetemp_data *st = s->private;
+	unsigned long now = jiffies;
+	struct drivetemp_history *h;
+	unsigned int i;
+
+	spin_lock(&st->data_lock);
+	for (i = 1; i <= st->history_len; i++) {
+		h = &st->history[(st->history_head + DRIVETEMP_HISTORY - i) %
+				 DRIVETEMP_HISTORY];
+		seq_printf(s, "%u %ld\n", jiffies_to_msecs(now - h->time),
+			   h->temp);
+	}
+	spin_unlock(&st->data_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(drivetemp_history);
 
-	err = drivetemp_ata_command(st, SMART_READ_LOG, SCT_STATUS_REQ_ADDR);
-	if (err)
-		return err;
-	switch (attr) {
-	case hwmon_temp_input:
-		*val = temp_from_sct(buf[SCT_STATUS_TEMP]);
-		break;
-	case hwmon_temp_lowest:
-		*val = temp_from_sct(buf[SCT_STATUS_TEMP_LOWEST]);
-		break;
-	case hwmon_temp_highest:
-		*val = temp_from_sct(buf[SCT_STATUS_TEMP_HIGHEST]);
-		break;
-	default:
-		err = -EINVAL;
-		break;
+static int drivetemp_sct_history_show(struct seq_file *s, void *v)
+{
+	struct drivetemp_data *st = s->private;
+	unsigned long now = jiffies;
+	struct drivetemp_history *h;
+	unsigned int i;
+
+	spin_lock(&st->data_lock);
+	for (i = 0; i < st->sct_history_len; i++) {
+		h = &st->sct_history[i];
+		seq_printf(s, "%u %ld\n", jiffies_to_msecs(now - h->time),
+			   h->temp);
 	}
-	return err;
+	spin_unlock(&st->data_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(drivetemp_sct_history);
+
+/*
+ * Identity of the ATA information VPD page, for detecting rescans which
+ * changed it. Contents are compared rather than the pointer, since a
+ * freed page may be reallocated at the same address by a later rescan.
+ * Must be called under rcu_read_lock().
+ */
+static u32 drivetemp_vpd_id(const struct scsi_vpd *vpd)
+{
+	if (!vpd)
+		return 0;
+	return jhash(vpd->data, vpd->len, vpd->len);
 }
 
 static int drivetemp_identify_sata(struct drivetemp_data *st)
@@ -287,6 +1823,7 @@ static int drivetemp_identify_sata(struct drivetemp_data *st)
 	bool have_sct_data_table;
 	bool have_sct_temp;
 	bool have_smart;
+	bool have_gpl;
 	bool have_sct;
 	u16 *ata_id;
 	u16 version;
@@ -296,6 +1833,7 @@ static int drivetemp_identify_sata(struct drivetemp_data *st)
 	/* SCSI-ATA Translation present? */
 	rcu_read_lock();
 	vpd = rcu_dereference(sdev->vpd_pg89);
+	st->vpd_id = drivetemp_vpd_id(vpd);
 
 	/*
 	 * Verify that ATA IDENTIFY DEVICE data is included in ATA Information
@@ -313,12 +1851,19 @@ static int drivetemp_identify_sata(struct drivetemp_data *st)
 	have_sct_data_table = ata_id_sct_data_tables(ata_id);
 	have_smart = ata_id_smart_supported(ata_id) &&
 				ata_id_smart_enabled(ata_id);
+	have_gpl = ata_id_gpl_supported(ata_id);
+	if (is_ata && is_sata)
+		drivetemp_cache_key(st, ata_id);
 
 	rcu_read_unlock();
 
 	/* bail out if this is not a SATA device */
 	if (!is_ata || !is_sata)
 		return -ENODEV;
+
+	/* Skip the expensive probe if cached results are still valid */
+	if (!drivetemp_identify_cached(st))
+		return 0;
 	if (!have_sct)
 		goto skip_sct;
 
@@ -342,7 +1887,7 @@ static int drivetemp_identify_sata(struct drivetemp_data *st)
 		goto skip_sct;
 
 	/* Request and read temperature history table */
-	memset(buf, '\0', sizeof(st->smartdata));
+	memset(buf, '\0', ATA_SECT_SIZE);
 	buf[0] = 5;	/* data table command */
 	buf[2] = 1;	/* read table */
 	buf[4] = 2;	/* temperature history table */
@@ -369,12 +1914,16 @@ static int drivetemp_identify_sata(struct drivetemp_data *st)
 	st->temp_min = temp_from_sct(buf[8]);
 	st->temp_lcrit = temp_from_sct(buf[9]);
 
+	drivetemp_history_seed(st, buf);
+
 skip_sct_data:
 	if (have_sct_temp) {
 		st->get_temp = drivetemp_get_scttemp;
 		return 0;
 	}
 skip_sct:
+	if (have_gpl && !drivetemp_identify_devstat(st))
+		return 0;
 	if (!have_smart)
 		return -ENODEV;
 	st->get_temp = drivetemp_get_smarttemp;
@@ -396,45 +1945,512 @@ static int drivetemp_identify(struct drivetemp_data *st)
 	if (!drivetemp_identify_sata(st))
 		return 0;
 
-	return -ENODEV;
+	if (!drivetemp_identify_ie(st))
+		return 0;
+
+	return -ENODEV;
+}
+
+struct drivetemp_identify_req {
+	struct work_struct work;
+	struct drivetemp_data *st;
+	int err;
+};
+
+static void drivetemp_identify_work(struct work_struct *work)
+{
+	struct drivetemp_identify_req *req =
+			container_of(work, struct drivetemp_identify_req, work);
+
+	req->err = drivetemp_identify(req->st);
+}
+
+/*
+ * Identify a drive at probe time from drivetemp_wq, so commands are not
+ * executed on the CPU of the task scanning the SCSI host.
+ */
+static int drivetemp_identify_wq(struct drivetemp_data *st)
+{
+	struct drivetemp_identify_req req = { .st = st };
+
+	INIT_WORK_ONSTACK(&req.work, drivetemp_identify_work);
+	queue_work(drivetemp_wq, &req.work);
+	flush_work(&req.work);
+	destroy_work_on_stack(&req.work);
+
+	return req.err;
+}
+
+/*
+ * A SCSI rescan (for example after a drive firmware update or a SAT bridge
+ * reconfiguration) replaces sdev->vpd_pg89. Detect this by comparing its
+ * contents with the ones seen during the last identification, and re-run
+ * identification from a work item if they changed.
+ */
+static void drivetemp_check_rescan(struct drivetemp_data *st)
+{
+	u32 id;
+
+	rcu_read_lock();
+	id = drivetemp_vpd_id(rcu_dereference(st->sdev->vpd_pg89));
+	rcu_read_unlock();
+
+	if (id != READ_ONCE(st->vpd_id))
+		drivetemp_queue(st, &st->rescan_work);
+}
+
+static void drivetemp_rescan_work(struct work_struct *work)
+{
+	struct drivetemp_data *st = container_of(work, struct drivetemp_data,
+						 rescan_work);
+	struct drivetemp_data *new;
+	u32 id;
+	int err;
+
+	/* Try again on the next read after the drive has been resumed */
+	if (drivetemp_gone(st) || drivetemp_quiesced(st))
+		goto put;
+
+	/*
+	 * Identification may fail before reading the VPD page; record the
+	 * page seen here, so a failed attempt is not repeated on every read.
+	 */
+	rcu_read_lock();
+	id = drivetemp_vpd_id(rcu_dereference(st->sdev->vpd_pg89));
+	rcu_read_unlock();
+
+	new = kzalloc(sizeof(*new), GFP_KERNEL);
+	if (!new)
+		goto put;
+	/*
+	 * Commands of the scratch copy are cancelled through the state of
+	 * the shared SCSI device if the drive goes away.
+	 */
+	new->sdev = st->sdev;
+	/* Serialized by st->lock, so the data buffer can be shared */
+	new->smartdata = st->smartdata;
+	spin_lock_init(&new->data_lock);
+
+	/*
+	 * Identify into a scratch copy while holding the lock, so commands
+	 * from readers can not interleave with the SCT command sequence.
+	 * The results are installed under st->data_lock, so readers see
+	 * either the old or the new method, never a mix.
+	 * The hwmon device is kept; attribute visibility is fixed at
+	 * registration time, and attributes no longer supported by the drive
+	 * return -ENODATA.
+	 */
+	mutex_lock(&st->lock);
+	err = drivetemp_identify(new);
+	st->svc_ns += new->svc_ns;
+	if (err) {
+		/* Keep using the old method, but don't try again */
+		WRITE_ONCE(st->vpd_id, id);
+		dev_warn(&st->sdev->sdev_gendev,
+			 "re-identification failed (%d)\n", err);
+		goto unlock;
+	}
+	spin_lock(&st->data_lock);
+	st->get_temp = new->get_temp;
+	st->have_temp_lowest = new->have_temp_lowest;
+	st->have_temp_highest = new->have_temp_highest;
+	st->have_temp_min = new->have_temp_min;
+	st->have_temp_max = new->have_temp_max;
+	st->have_temp_lcrit = new->have_temp_lcrit;
+	st->have_temp_crit = new->have_temp_crit;
+	st->have_temp_alarm = new->have_temp_alarm;
+	st->temp_alarm = new->temp_alarm;
+	st->ie_asc = new->ie_asc;
+	st->ie_ascq = new->ie_ascq;
+	st->unsupported = false;
+	memcpy(st->cache_key, new->cache_key, sizeof(st->cache_key));
+	memcpy(st->sct_history, new->sct_history, sizeof(st->sct_history));
+	st->sct_history_len = new->sct_history_len;
+	st->temp_min = new->temp_min;
+	st->temp_max = new->temp_max;
+	st->temp_lcrit = new->temp_lcrit;
+	st->temp_crit = new->temp_crit;
+	spin_unlock(&st->data_lock);
+	WRITE_ONCE(st->vpd_id, id);
+unlock:
+	mutex_unlock(&st->lock);
+	kfree(new);
+put:
+	drivetemp_put(st);
+}
+
+/*
+ * Background refresh runs on a common timeline of fixed length slots.
+ * Refresh times are rounded up to the next slot boundary, so drives due
+ * in the same slot are sampled from a single wakeup. The work is deferrable,
+ * so it does not wake up idle CPUs by itself.
+ */
+static unsigned long drivetemp_slot(unsigned long t)
+{
+	unsigned long slot = max(msecs_to_jiffies(READ_ONCE(refresh_slot)), 1UL);
+
+	return roundup(t, slot);
+}
+
+/*
+ * Read a temperature using the current method. If the drive rejects the
+ * method permanently, stop using it and re-run identification in the
+ * background to find another one. Must be called with st->lock held.
+ */
+static int drivetemp_get_temp(struct drivetemp_data *st, u32 attr, long *val)
+{
+	int err;
+
+	if (st->unsupported)
+		return -EOPNOTSUPP;
+	if (drivetemp_quiesced(st))
+		return -EAGAIN;
+
+	err = st->get_temp(st, attr, val);
+	if (err == -EOPNOTSUPP) {
+		st->unsupported = true;
+		drivetemp_queue(st, &st->rescan_work);
+	}
+	return err;
+}
+
+/*
+ * Duty cycle controller. The service time of each sample is measured and
+ * averaged, and the minimum sampling interval is adjusted such that the
+ * fraction of time spent executing monitoring commands stays below
+ * duty_cycle_ppm. The interval is raised immediately if commands become
+ * slower, and decays slowly if they become faster, so short latency dips
+ * do not cause bursts of sampling. Must be called with st->lock and
+ * st->data_lock held.
+ */
+static void drivetemp_duty_cycle_update(struct drivetemp_data *st, u64 cost)
+{
+	unsigned int ppm = READ_ONCE(duty_cycle_ppm);
+	unsigned int target;
+
+	if (!st->svc_avg_ns)
+		st->svc_avg_ns = cost;
+	else
+		st->svc_avg_ns = st->svc_avg_ns - (st->svc_avg_ns >> 3) +
+				 (cost >> 3);
+
+	if (!ppm) {
+		st->min_interval = 0;
+		return;
+	}
+
+	/* interval >= service time * 10^6 / ppm; ns to ms divides by 10^6 */
+	target = min_t(u64, DIV_ROUND_UP_ULL(st->svc_avg_ns, ppm), INT_MAX);
+	if (target >= st->min_interval)
+		st->min_interval = target;
+	else
+		st->min_interval -= (st->min_interval - target + 3) / 4;
+}
+
+/*
+ * Effective sampling interval in ms. Must be called with st->data_lock
+ * held.
+ */
+static unsigned int drivetemp_interval(struct drivetemp_data *st)
+{
+	if (!READ_ONCE(duty_cycle_ppm))
+		return st->update_interval;
+	return max(st->update_interval, st->min_interval);
+}
+
+/*
+ * Sample the temperature. The service time of all commands issued since
+ * the previous sample, including identification, is charged to the duty
+ * cycle. Must be called with st->lock held.
+ */
+static int drivetemp_sample(struct drivetemp_data *st)
+{
+	unsigned long now;
+	long temp;
+	int err;
+
+	err = drivetemp_get_temp(st, hwmon_temp_input, &temp);
+	now = jiffies;
+
+	spin_lock(&st->data_lock);
+	if (!err) {
+		st->temp_input = temp;
+		st->last_updated = now;
+		st->valid = true;
+		drivetemp_history_add(st, now, temp);
+	}
+	if (st->svc_ns)
+		drivetemp_duty_cycle_update(st, st->svc_ns);
+	st->svc_ns = 0;
+	st->next_update = drivetemp_slot(now +
+				msecs_to_jiffies(drivetemp_interval(st)));
+	spin_unlock(&st->data_lock);
+	return err;
+}
+
+/* Must be called with drivetemp_list_lock held */
+static void drivetemp_refresh_schedule(void)
+{
+	struct drivetemp_data *st;
+	unsigned long next = 0;
+	bool pending = false;
+
+	list_for_each_entry(st, &drivetemp_devlist, list) {
+		spin_lock(&st->data_lock);
+		if (st->update_interval &&
+		    (!pending || time_before(st->next_update, next))) {
+			next = st->next_update;
+			pending = true;
+		}
+		spin_unlock(&st->data_lock);
+	}
+	if (!pending)
+		return;
+
+	next = drivetemp_slot(next);
+	mod_delayed_work_on(housekeeping_any_cpu(DRIVETEMP_HK_TIMER),
+			    drivetemp_wq, &drivetemp_refresh_work,
+			    time_after(next, jiffies) ? next - jiffies : 0);
+}
+
+static void drivetemp_sample_work(struct work_struct *work)
+{
+	struct drivetemp_data *st = container_of(work, struct drivetemp_data,
+						 sample_work);
+
+	drivetemp_check_rescan(st);
+	mutex_lock(&st->lock);
+	drivetemp_sample(st);
+	mutex_unlock(&st->lock);
+	drivetemp_put(st);
+}
+
+/*
+ * Devices due for refresh are collected from a single wakeup, and each is
+ * sampled from its own work item on drivetemp_wq, so a slow or unresponsive
+ * drive does not delay the others. The next refresh of a queued device is
+ * set when it is queued, so the next wakeup does not depend on when its
+ * sample completes; the sample sets it again.
+ */
+static void drivetemp_refresh(struct work_struct *work)
+{
+	struct drivetemp_data *st;
+	bool due;
+
+	mutex_lock(&drivetemp_list_lock);
+	list_for_each_entry(st, &drivetemp_devlist, list) {
+		spin_lock(&st->data_lock);
+		due = st->update_interval &&
+		      !time_before(jiffies, st->next_update);
+		if (due)
+			st->next_update = drivetemp_slot(jiffies +
+				msecs_to_jiffies(drivetemp_interval(st)));
+		spin_unlock(&st->data_lock);
+		if (due)
+			drivetemp_queue(st, &st->sample_work);
+	}
+	drivetemp_refresh_schedule();
+	mutex_unlock(&drivetemp_list_lock);
 }
 
-static int drivetemp_read(struct device *dev, enum hwmon_sensor_types type,
-			 u32 attr, int channel, long *val)
+/*
+ * Cached samples are valid for one interval plus one slot of timer slack.
+ * Must be called with st->data_lock held.
+ */
+static bool drivetemp_cache_valid(struct drivetemp_data *st)
 {
-	struct drivetemp_data *st = dev_get_drvdata(dev);
-	int err = 0;
+	unsigned int interval = drivetemp_interval(st);
 
-	if (type != hwmon_temp)
-		return -EINVAL;
+	return interval && st->valid &&
+		time_before(jiffies, st->last_updated +
+			    msecs_to_jiffies(interval) +
+			    msecs_to_jiffies(READ_ONCE(refresh_slot)));
+}
+
+/* Attributes sampled from the drive; limits are fixed at identification */
+static bool drivetemp_sampled(u32 attr)
+{
+	return attr == hwmon_temp_input || attr == hwmon_temp_lowest ||
+	       attr == hwmon_temp_highest || attr == hwmon_temp_alarm;
+}
 
+/*
+ * Report the cached value of an attribute. Returns -EAGAIN if the drive
+ * has not been sampled yet. Must be called with st->data_lock held.
+ */
+static int drivetemp_cached(struct drivetemp_data *st, u32 attr, long *val)
+{
 	switch (attr) {
 	case hwmon_temp_input:
+		*val = st->temp_input;
+		return st->valid ? 0 : -EAGAIN;
 	case hwmon_temp_lowest:
+		if (!st->have_temp_lowest)
+			return -ENODATA;
+		*val = st->temp_lowest;
+		return st->valid_lowest ? 0 : -EAGAIN;
 	case hwmon_temp_highest:
-		mutex_lock(&st->lock);
-		err = st->get_temp(st, attr, val);
-		mutex_unlock(&st->lock);
-		break;
+		if (!st->have_temp_highest)
+			return -ENODATA;
+		*val = st->temp_highest;
+		return st->valid_highest ? 0 : -EAGAIN;
+	case hwmon_temp_alarm:
+		if (!st->have_temp_alarm)
+			return -ENODATA;
+		*val = st->temp_alarm;
+		return st->valid ? 0 : -EAGAIN;
 	case hwmon_temp_lcrit:
 		*val = st->temp_lcrit;
-		break;
+		return st->have_temp_lcrit ? 0 : -ENODATA;
 	case hwmon_temp_min:
 		*val = st->temp_min;
-		break;
+		return st->have_temp_min ? 0 : -ENODATA;
 	case hwmon_temp_max:
 		*val = st->temp_max;
-		break;
+		return st->have_temp_max ? 0 : -ENODATA;
 	case hwmon_temp_crit:
 		*val = st->temp_crit;
-		break;
+		return st->have_temp_crit ? 0 : -ENODATA;
 	default:
-		err = -EINVAL;
-		break;
+		return -EINVAL;
+	}
+}
+
+/*
+ * Cached values are reported while they are valid, or while the drive is
+ * quiesced. Must be called with st->data_lock held.
+ */
+static bool drivetemp_fresh(struct drivetemp_data *st)
+{
+	return drivetemp_cache_valid(st) || drivetemp_quiesced(st);
+}
+
+/*
+ * Read a temperature or alarm attribute, sampling the drive if the cached
+ * value is stale. Lowest and highest temperature and the alarm are sampled
+ * with temp_input, and subject to the same limits. Must be called with
+ * st->lock held.
+ */
+static int drivetemp_read_temp(struct drivetemp_data *st, u32 attr, long *val)
+{
+	bool fresh;
+	int err;
+
+	/* Another reader may have sampled the drive meanwhile */
+	spin_lock(&st->data_lock);
+	fresh = drivetemp_fresh(st);
+	spin_unlock(&st->data_lock);
+
+	if (!fresh) {
+		err = drivetemp_sample(st);
+		if (err)
+			return err;
+	}
+
+	spin_lock(&st->data_lock);
+	err = drivetemp_cached(st, attr, val);
+	spin_unlock(&st->data_lock);
+	return err;
+}
+
+static void drivetemp_read_work(struct work_struct *work)
+{
+	struct drivetemp_data *st = container_of(work, struct drivetemp_data,
+						 read_work);
+
+	mutex_lock(&st->lock);
+	st->read_err = drivetemp_read_temp(st, st->read_attr, &st->read_val);
+	mutex_unlock(&st->lock);
+
+	smp_store_release(&st->read_done, true);
+	wake_up(&st->read_wait);
+	drivetemp_put(st);
+}
+
+/*
+ * Read from drivetemp_wq, so commands are not executed on the CPU of the
+ * reading task. The reader never takes st->lock, and stops waiting when
+ * the device is removed, so hwmon unregistration does not wait for a
+ * command; the work item holds its own reference.
+ */
+static int drivetemp_read_wq(struct drivetemp_data *st, u32 attr, long *val)
+{
+	int err;
+
+	mutex_lock(&st->read_lock);
+	/* An abandoned read_work may still be running */
+	if (READ_ONCE(st->removing)) {
+		err = -ENODEV;
+		goto unlock;
+	}
+	st->read_attr = attr;
+	st->read_done = false;
+	drivetemp_queue(st, &st->read_work);
+	wait_event(st->read_wait, smp_load_acquire(&st->read_done) ||
+				  READ_ONCE(st->removing));
+	if (smp_load_acquire(&st->read_done)) {
+		*val = st->read_val;
+		err = st->read_err;
+	} else {
+		err = -ENODEV;
 	}
+unlock:
+	mutex_unlock(&st->read_lock);
 	return err;
 }
 
+static int drivetemp_read(struct device *dev, enum hwmon_sensor_types type,
+			 u32 attr, int channel, long *val)
+{
+	struct drivetemp_data *st = dev_get_drvdata(dev);
+	bool fresh;
+	int err;
+
+	if (type == hwmon_chip && attr == hwmon_chip_update_interval) {
+		spin_lock(&st->data_lock);
+		*val = st->update_interval;
+		spin_unlock(&st->data_lock);
+		return 0;
+	}
+	if (type != hwmon_temp)
+		return -EINVAL;
+
+	drivetemp_check_rescan(st);
+
+	/* Return cached values directly */
+	spin_lock(&st->data_lock);
+	err = drivetemp_cached(st, attr, val);
+	fresh = !drivetemp_sampled(attr) || drivetemp_fresh(st);
+	spin_unlock(&st->data_lock);
+
+	if (fresh || err == -ENODATA)
+		return err;
+
+	return drivetemp_read_wq(st, attr, val);
+}
+
+static int drivetemp_write(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, long val)
+{
+	struct drivetemp_data *st = dev_get_drvdata(dev);
+
+	if (type != hwmon_chip || attr != hwmon_chip_update_interval)
+		return -EOPNOTSUPP;
+	if (val < 0)
+		return -EINVAL;
+
+	spin_lock(&st->data_lock);
+	st->update_interval = clamp_val(val, 0, INT_MAX);
+	st->next_update = drivetemp_slot(jiffies);
+	spin_unlock(&st->data_lock);
+
+	mutex_lock(&drivetemp_list_lock);
+	drivetemp_refresh_schedule();
+	mutex_unlock(&drivetemp_list_lock);
+
+	return 0;
+}
+
 static umode_t drivetemp_is_visible(const void *data,
 				   enum hwmon_sensor_types type,
 				   u32 attr, int channel)
@@ -442,6 +2458,10 @@ static umode_t drivetemp_is_visible(const void *data,
 	const struct drivetemp_data *st = data;
 
 	switch (type) {
+	case hwmon_chip:
+		if (attr == hwmon_chip_update_interval)
+			return 0644;
+		break;
 	case hwmon_temp:
 		switch (attr) {
 		case hwmon_temp_input:
@@ -470,6 +2490,10 @@ static umode_t drivetemp_is_visible(const void *data,
 			if (st->have_temp_crit)
 				return 0444;
 			break;
+		case hwmon_temp_alarm:
+			if (st->have_temp_alarm)
+				return 0444;
+			break;
 		default:
 			break;
 		}
@@ -482,17 +2506,19 @@ static umode_t drivetemp_is_visible(const void *data,
 
 static const struct hwmon_channel_info *drivetemp_info[] = {
 	HWMON_CHANNEL_INFO(chip,
-			   HWMON_C_REGISTER_TZ),
+			   HWMON_C_REGISTER_TZ | HWMON_C_UPDATE_INTERVAL),
 	HWMON_CHANNEL_INFO(temp, HWMON_T_INPUT |
 			   HWMON_T_LOWEST | HWMON_T_HIGHEST |
 			   HWMON_T_MIN | HWMON_T_MAX |
-			   HWMON_T_LCRIT | HWMON_T_CRIT),
+			   HWMON_T_LCRIT | HWMON_T_CRIT |
+			   HWMON_T_ALARM),
 	NULL
 };
 
 static const struct hwmon_ops drivetemp_ops = {
 	.is_visible = drivetemp_is_visible,
 	.read = drivetemp_read,
+	.write = drivetemp_write,
 };
 
 static const struct hwmon_chip_info drivetemp_chip_info = {
@@ -500,6 +2526,433 @@ static const struct hwmon_chip_info drivetemp_chip_info = {
 	.info = drivetemp_info,
 };
 
+/*
+ * Character device for batched temperature queries, see drivetemp.h.
+ * Queries are served from the cache if it is fresh enough, and from the
+ * drive otherwise. Each drive of a query is read from its own work item on
+ * drivetemp_wq, so a query takes about as long as its slowest drive, not
+ * the sum of all. io_uring passthrough commands complete asynchronously,
+ * so many queries can be in flight without a thread per drive; results are
+ * copied to userspace from task context.
+ */
+struct drivetemp_query_ctx;
+
+struct drivetemp_query_item {
+	struct work_struct work;
+	struct drivetemp_query_ctx *ctx;
+};
+
+struct drivetemp_query_ctx {
+	refcount_t refs;
+	atomic_t pending;		/* items not completed yet */
+	void (*done)(struct drivetemp_query_ctx *ctx);
+	struct completion completion;	/* all items completed */
+#ifdef DRIVETEMP_URING_CMD
+	struct io_uring_cmd *ioucmd;
+#endif
+	u64 results;			/* userspace results pointer */
+	unsigned long max_age;		/* freshness bound, jiffies */
+	u32 count;
+	struct drivetemp_query_item *items;
+	struct drivetemp_result res[];
+};
+
+/*
+ * Report the cached temperature if it is no older than max_age, or if the
+ * drive is quiesced. Returns -ESTALE if the drive needs to be sampled.
+ * Must be called with st->data_lock held.
+ */
+static int drivetemp_query_cached(struct drivetemp_data *st,
+				  unsigned long max_age,
+				  struct drivetemp_result *r)
+{
+	unsigned long age = jiffies - st->last_updated;
+
+	if (drivetemp_quiesced(st)) {
+		if (!st->valid)
+			return -EAGAIN;
+	} else {
+		/* The duty cycle limit takes precedence */
+		if (READ_ONCE(duty_cycle_ppm))
+			max_age = max(max_age,
+				      msecs_to_jiffies(st->min_interval));
+		if (!st->valid || age > max_age)
+			return -ESTALE;
+	}
+	r->temp = st->temp_input;
+	r->age_ms = jiffies_to_msecs(age);
+	return 0;
+}
+
+static int drivetemp_query_one(unsigned long max_age, struct drivetemp_result *r)
+{
+	struct drivetemp_data *st;
+	int err;
+
+	/* Devices are removed from the index before their reference is put */
+	xa_lock(&drivetemp_devs);
+	st = xa_load(&drivetemp_devs, r->hwmon);
+	if (st)
+		kref_get(&st->kref);
+	xa_unlock(&drivetemp_devs);
+
+	if (!st)
+		return -ENODEV;
+
+	drivetemp_check_rescan(st);
+
+	/* Answer from the cache without waiting for a command in progress */
+	spin_lock(&st->data_lock);
+	err = drivetemp_query_cached(st, max_age, r);
+	spin_unlock(&st->data_lock);
+
+	if (err == -ESTALE) {
+		mutex_lock(&st->lock);
+		/* Another reader may have sampled the drive meanwhile */
+		spin_lock(&st->data_lock);
+		err = drivetemp_query_cached(st, max_age, r);
+		spin_unlock(&st->data_lock);
+		if (err == -ESTALE) {
+			err = drivetemp_sample(st);
+			if (!err) {
+				spin_lock(&st->data_lock);
+				err = drivetemp_query_cached(st, ULONG_MAX, r);
+				spin_unlock(&st->data_lock);
+			}
+		}
+		mutex_unlock(&st->lock);
+	}
+
+	drivetemp_put(st);
+	return err;
+}
+
+static void drivetemp_query_put(struct drivetemp_query_ctx *ctx)
+{
+	if (refcount_dec_and_test(&ctx->refs)) {
+		kvfree(ctx->items);
+		kvfree(ctx);
+	}
+}
+
+static void drivetemp_query_item_work(struct work_struct *work)
+{
+	struct drivetemp_query_item *item =
+			container_of(work, struct drivetemp_query_item, work);
+	struct drivetemp_query_ctx *ctx = item->ctx;
+	struct drivetemp_result *r = &ctx->res[item - ctx->items];
+
+	r->temp = 0;
+	r->age_ms = 0;
+	r->status = drivetemp_query_one(ctx->max_age, r);
+
+	if (atomic_dec_and_test(&ctx->pending))
+		ctx->done(ctx);
+}
+
+/* The context may be gone when this returns */
+static void drivetemp_query_submit(struct drivetemp_query_ctx *ctx,
+				   void (*done)(struct drivetemp_query_ctx *ctx))
+{
+	u32 count = ctx->count;
+	u32 i;
+
+	ctx->done = done;
+	atomic_set(&ctx->pending, count);
+	for (i = 0; i < count; i++) {
+		ctx->items[i].ctx = ctx;
+		INIT_WORK(&ctx->items[i].work, drivetemp_query_item_work);
+	}
+	for (i = 0; i < count; i++)
+		queue_work(drivetemp_wq, &ctx->items[i].work);
+}
+
+/* Must be called from the context of the submitting task */
+static struct drivetemp_query_ctx *
+drivetemp_query_alloc(u64 results, u32 count, u32 max_age_ms)
+{
+	struct drivetemp_query_ctx *ctx;
+
+	if (!count || count > DRIVETEMP_MAX_QUERY)
+		return ERR_PTR(-EINVAL);
+
+	ctx = kvmalloc(struct_size(ctx, res, count), GFP_KERNEL);
+	if (!ctx)
+		return ERR_PTR(-ENOMEM);
+
+	ctx->items = kvmalloc_array(count, sizeof(*ctx->items), GFP_KERNEL);
+	if (!ctx->items) {
+		kvfree(ctx);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	refcount_set(&ctx->refs, 1);
+	init_completion(&ctx->completion);
+	ctx->results = results;
+	ctx->count = count;
+	ctx->max_age = msecs_to_jiffies(max_age_ms);
+	if (copy_from_user(ctx->res, u64_to_user_ptr(results),
+			   count * sizeof(ctx->res[0]))) {
+		drivetemp_query_put(ctx);
+		return ERR_PTR(-EFAULT);
+	}
+	return ctx;
+}
+
+/* Must be called from the context of the submitting task */
+static int drivetemp_query_copy_results(struct drivetemp_query_ctx *ctx)
+{
+	if (copy_to_user(u64_to_user_ptr(ctx->results), ctx->res,
+			 ctx->count * sizeof(ctx->res[0])))
+		return -EFAULT;
+	return 0;
+}
+
+static void drivetemp_query_complete(struct drivetemp_query_ctx *ctx)
+{
+	complete(&ctx->completion);
+	drivetemp_query_put(ctx);
+}
+
+static long drivetemp_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	struct drivetemp_query_ctx *ctx;
+	struct drivetemp_query q;
+	int err;
+
+	if (cmd != DRIVETEMP_IOC_QUERY)
+		return -ENOTTY;
+
+	if (copy_from_user(&q, (void __user *)arg, sizeof(q)))
+		return -EFAULT;
+
+	ctx = drivetemp_query_alloc(q.results, q.count, q.max_age_ms);
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	/*
+	 * One reference for the caller and one for the completion, so a
+	 * killed caller can return while items are still executing.
+	 */
+	refcount_inc(&ctx->refs);
+	drivetemp_query_submit(ctx, drivetemp_query_complete);
+
+	err = wait_for_completion_killable(&ctx->completion);
+	if (!err)
+		err = drivetemp_query_copy_results(ctx);
+	drivetemp_query_put(ctx);
+
+	return err;
+}
+
+#ifdef DRIVETEMP_URING_CMD
+static void drivetemp_uring_task_done(struct io_uring_cmd *ioucmd)
+{
+	struct drivetemp_query_ctx *ctx =
+				*(struct drivetemp_query_ctx **)ioucmd->pdu;
+	int err;
+
+	err = drivetemp_query_copy_results(ctx);
+	io_uring_cmd_done(ioucmd, err, 0);
+	drivetemp_query_put(ctx);
+}
+
+static void drivetemp_uring_done(struct drivetemp_query_ctx *ctx)
+{
+	io_uring_cmd_complete_in_task(ctx->ioucmd, drivetemp_uring_task_done);
+}
+
+static int drivetemp_uring_cmd(struct io_uring_cmd *ioucmd,
+			       unsigned int issue_flags)
+{
+	const struct drivetemp_query *q = ioucmd->cmd;
+	struct drivetemp_query_ctx *ctx;
+
+	if (ioucmd->cmd_op != DRIVETEMP_IOC_QUERY)
+		return -ENOTTY;
+
+	/* The command area is shared with userspace; read it only once */
+	ctx = drivetemp_query_alloc(READ_ONCE(q->results), READ_ONCE(q->count),
+				    READ_ONCE(q->max_age_ms));
+	if (IS_ERR(ctx))
+		return PTR_ERR(ctx);
+
+	ctx->ioucmd = ioucmd;
+	*(struct drivetemp_query_ctx **)ioucmd->pdu = ctx;
+	drivetemp_query_submit(ctx, drivetemp_uring_done);
+
+	return -EIOCBQUEUED;
+}
+#endif
+
+static const struct file_operations drivetemp_fops = {
+	.owner = THIS_MODULE,
+	.unlocked_ioctl = drivetemp_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+#ifdef DRIVETEMP_URING_CMD
+	.uring_cmd = drivetemp_uring_cmd,
+#endif
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice drivetemp_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "drivetemp",
+	.fops = &drivetemp_fops,
+};
+
+/* Return true if str matches one of the comma separated patterns in list */
+static bool drivetemp_match_list(const char *list, const char *str)
+{
+	char pattern[64];
+	const char *end;
+	size_t len;
+
+	while (list && *list) {
+		end = strchrnul(list, ',');
+		len = end - list;
+		if (len && len < sizeof(pattern)) {
+			memcpy(pattern, list, len);
+			pattern[len] = '\0';
+			if (glob_match(pattern, str))
+				return true;
+		}
+		list = *end ? end + 1 : NULL;
+	}
+	return false;
+}
+
+/* Copy a space padded inquiry string and terminate it */
+static void drivetemp_inquiry_str(char *dst, const char *src, size_t len)
+{
+	memcpy(dst, src, len);
+	while (len && dst[len - 1] == ' ')
+		len--;
+	dst[len] = '\0';
+}
+
+/*
+ * Attach filter. Probing some devices, such as remote iSCSI or FC LUNs or
+ * RAID logical volumes, costs round trips to remote targets or controller
+ * firmware, and is pointless. Reject them based on data already known to
+ * the SCSI core, before issuing any command.
+ */
+static bool drivetemp_skip(struct scsi_device *sdev)
+{
+	struct Scsi_Host *shost = sdev->host;
+	const struct class *tclass = NULL;
+	char id[8 + 1 + 16 + 1];
+	const char *name;
+	int i;
+
+	for (i = 0; i < num_skip_host_nos; i++) {
+		if (shost->host_no == skip_host_nos[i])
+			return true;
+	}
+
+	if (skip_transports && shost->transportt)
+		tclass = shost->transportt->host_attrs.ac.class;
+	if (tclass && tclass->name &&
+	    drivetemp_match_list(skip_transports, tclass->name))
+		return true;
+
+	name = shost->hostt->proc_name ? : shost->hostt->name;
+	if (skip_hosts && name && drivetemp_match_list(skip_hosts, name))
+		return true;
+
+	if (skip_models && sdev->inquiry && sdev->inquiry_len >= 32) {
+		drivetemp_inquiry_str(id, sdev->vendor, 8);
+		strcat(id, ":");
+		drivetemp_inquiry_str(id + strlen(id), sdev->model, 16);
+		if (drivetemp_match_list(skip_models, id))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Probe and remove statistics, for tracking how the driver scales with the
+ * number of drives. Reported in the stats file in the drivetemp debugfs
+ * directory. Memory is the slab memory allocated by the driver for bound
+ * drives; memory of hwmon devices and their attributes is not included.
+ * tools/scale-bench.sh measures that from the slab usage of the system.
+ */
+static struct {
+	u64 init_ns;			/* module load, incl. initial probes */
+	u64 probes;			/* probed devices */
+	u64 probes_failed;		/* devices not bound */
+	u64 probe_ns;			/* total time spent probing */
+	u64 probe_max_ns;		/* longest probe */
+	u64 removes;			/* removed devices */
+	u64 remove_ns;			/* total time spent removing */
+	u64 remove_max_ns;		/* longest remove */
+	unsigned int devices;		/* bound devices */
+	size_t bytes;			/* memory allocated for bound devices */
+} drivetemp_stats;
+
+static DEFINE_SPINLOCK(drivetemp_stats_lock);	/* protect drivetemp_stats */
+
+static size_t drivetemp_bytes(struct drivetemp_data *st)
+{
+	return ksize(st) + ksize(st->smartdata);
+}
+
+static void drivetemp_stats_probe(ktime_t start, struct drivetemp_data *st)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&drivetemp_stats_lock);
+	drivetemp_stats.probes++;
+	drivetemp_stats.probe_ns += ns;
+	drivetemp_stats.probe_max_ns = max(drivetemp_stats.probe_max_ns, ns);
+	if (st) {
+		drivetemp_stats.devices++;
+		drivetemp_stats.bytes += drivetemp_bytes(st);
+	} else {
+		drivetemp_stats.probes_failed++;
+	}
+	spin_unlock(&drivetemp_stats_lock);
+}
+
+static void drivetemp_stats_remove(ktime_t start, size_t bytes)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&drivetemp_stats_lock);
+	drivetemp_stats.removes++;
+	drivetemp_stats.remove_ns += ns;
+	drivetemp_stats.remove_max_ns = max(drivetemp_stats.remove_max_ns, ns);
+	drivetemp_stats.devices--;
+	drivetemp_stats.bytes -= bytes;
+	spin_unlock(&drivetemp_stats_lock);
+}
+
+static int drivetemp_stats_show(struct seq_file *s, void *v)
+{
+	typeof(drivetemp_stats) stats;
+
+	spin_lock(&drivetemp_stats_lock);
+	stats = drivetemp_stats;
+	spin_unlock(&drivetemp_stats_lock);
+
+	seq_printf(s, "init_ns %llu\n", stats.init_ns);
+	seq_printf(s, "probes %llu\n", stats.probes);
+	seq_printf(s, "probes_failed %llu\n", stats.probes_failed);
+	seq_printf(s, "probe_ns %llu\n", stats.probe_ns);
+	seq_printf(s, "probe_max_ns %llu\n", stats.probe_max_ns);
+	seq_printf(s, "removes %llu\n", stats.removes);
+	seq_printf(s, "remove_ns %llu\n", stats.remove_ns);
+	seq_printf(s, "remove_max_ns %llu\n", stats.remove_max_ns);
+	seq_printf(s, "devices %u\n", stats.devices);
+	seq_printf(s, "bytes %zu\n", stats.bytes);
+	seq_printf(s, "bytes_per_device %zu\n",
+		   stats.devices ? stats.bytes / stats.devices : 0);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(drivetemp_stats);
+
 /*
  * The device argument points to sdev->sdev_dev. Its parent is
  * sdev->sdev_gendev, which we can use to get the scsi_device pointer.
@@ -507,50 +2960,122 @@ static const struct hwmon_chip_info drivetemp_chip_info = {
 static int drivetemp_add(struct device *dev, struct class_interface *intf)
 {
 	struct scsi_device *sdev = to_scsi_device(dev->parent);
+	ktime_t start = ktime_get();
 	struct drivetemp_data *st;
 	int err;
 
+	if (drivetemp_skip(sdev)) {
+		dev_dbg(&sdev->sdev_gendev, "skipped by attach filter\n");
+		drivetemp_stats_probe(start, NULL);
+		return -ENODEV;
+	}
+
 	st = kzalloc(sizeof(*st), GFP_KERNEL);
-	if (!st)
+	if (!st) {
+		drivetemp_stats_probe(start, NULL);
 		return -ENOMEM;
+	}
 
+	/* Work items may outlive the SCSI device's registration */
 	st->sdev = sdev;
+	get_device(&sdev->sdev_gendev);
+	kref_init(&st->kref);
+
+	st->smartdata = kmalloc(DRIVETEMP_BUF_SIZE, GFP_KERNEL);
+	if (!st->smartdata) {
+		err = -ENOMEM;
+		goto abort;
+	}
+
 	st->dev = dev;
+	st->update_interval = update_interval;
 	mutex_init(&st->lock);
-
-	if (drivetemp_identify(st)) {
+	spin_lock_init(&st->data_lock);
+	mutex_init(&st->read_lock);
+	init_waitqueue_head(&st->read_wait);
+	INIT_WORK(&st->rescan_work, drivetemp_rescan_work);
+	INIT_WORK(&st->read_work, drivetemp_read_work);
+	INIT_WORK(&st->sample_work, drivetemp_sample_work);
+
+	if (drivetemp_identify_wq(st)) {
 		err = -ENODEV;
 		goto abort;
 	}
 
 	st->hwdev = hwmon_device_register_with_info(dev->parent, "drivetemp",
 						    st, &drivetemp_chip_info,
-						    NULL);
+						    drivetemp_groups);
 	if (IS_ERR(st->hwdev)) {
 		err = PTR_ERR(st->hwdev);
 		goto abort;
 	}
+	if (sscanf(dev_name(st->hwdev), "hwmon%u", &st->hwmon_id) != 1) {
+		st->hwmon_id = UINT_MAX;
+	} else {
+		err = xa_insert(&drivetemp_devs, st->hwmon_id, st, GFP_KERNEL);
+		if (err) {
+			hwmon_device_unregister(st->hwdev);
+			goto abort;
+		}
+	}
 
+	st->debugfs = debugfs_create_dir(dev_name(&sdev->sdev_gendev),
+					 drivetemp_debugfs);
+	debugfs_create_file("history", 0400, st->debugfs, st,
+			    &drivetemp_history_fops);
+	debugfs_create_file("sct_history", 0400, st->debugfs, st,
+			    &drivetemp_sct_history_fops);
+
+	mutex_lock(&drivetemp_list_lock);
+	st->next_update = drivetemp_slot(jiffies);
 	list_add(&st->list, &drivetemp_devlist);
+	drivetemp_refresh_schedule();
+	mutex_unlock(&drivetemp_list_lock);
+
+	drivetemp_stats_probe(start, st);
 	return 0;
 
 abort:
-	kfree(st);
+	drivetemp_put(st);
+	drivetemp_stats_probe(start, NULL);
 	return err;
 }
 
 static void drivetemp_remove(struct device *dev, struct class_interface *intf)
 {
+	ktime_t start = ktime_get();
 	struct drivetemp_data *st, *tmp;
+	size_t bytes;
 
+	mutex_lock(&drivetemp_list_lock);
 	list_for_each_entry_safe(st, tmp, &drivetemp_devlist, list) {
 		if (st->dev == dev) {
 			list_del(&st->list);
+			/* Before the hwmon index can be reused */
+			if (st->hwmon_id != UINT_MAX)
+				xa_erase(&drivetemp_devs, st->hwmon_id);
+			/*
+			 * Unregistering waits for sysfs accesses, which may
+			 * need drivetemp_list_lock. Drop it first.
+			 */
+			mutex_unlock(&drivetemp_list_lock);
+			/*
+			 * Cancel commands not issued yet, including retries,
+			 * and release readers waiting for one. A command in
+			 * progress completes in the background; its work item
+			 * holds a reference to st.
+			 */
+			WRITE_ONCE(st->removing, true);
+			wake_up_all(&st->read_wait);
 			hwmon_device_unregister(st->hwdev);
-			kfree(st);
-			break;
+			debugfs_remove_recursive(st->debugfs);
+			bytes = drivetemp_bytes(st);
+			drivetemp_put(st);
+			drivetemp_stats_remove(start, bytes);
+			return;
 		}
 	}
+	mutex_unlock(&drivetemp_list_lock);
 }
 
 static struct class_interface drivetemp_interface = {
@@ -560,12 +3085,58 @@ static struct class_interface drivetemp_interface = {
 
 static int __init drivetemp_init(void)
 {
-	return scsi_register_interface(&drivetemp_interface);
+	ktime_t start = ktime_get();
+	int err;
+
+	drivetemp_wq = alloc_workqueue("drivetemp", WQ_UNBOUND | WQ_SYSFS,
+				       wq_max_active);
+	if (!drivetemp_wq) {
+		err = -ENOMEM;
+		goto err_cache;
+	}
+
+	drivetemp_debugfs = debugfs_create_dir("drivetemp", NULL);
+	debugfs_create_file("trace", 0600, drivetemp_debugfs, NULL,
+			    &drivetemp_trace_fops);
+	debugfs_create_file("replay", 0200, drivetemp_debugfs, NULL,
+			    &drivetemp_replay_fops);
+	debugfs_create_file("stats", 0400, drivetemp_debugfs, NULL,
+			    &drivetemp_stats_fops);
+
+	err = misc_register(&drivetemp_miscdev);
+	if (err)
+		goto err_debugfs;
+
+	/* Probes all existing SCSI devices */
+	err = scsi_register_interface(&drivetemp_interface);
+	if (err)
+		goto err_misc;
+
+	spin_lock(&drivetemp_stats_lock);
+	drivetemp_stats.init_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_unlock(&drivetemp_stats_lock);
+	return 0;
+
+err_misc:
+	misc_deregister(&drivetemp_miscdev);
+err_debugfs:
+	debugfs_remove_recursive(drivetemp_debugfs);
+	destroy_workqueue(drivetemp_wq);
+err_cache:
+	drivetemp_cache_free();
+	return err;
 }
 
 static void __exit drivetemp_exit(void)
 {
+	misc_deregister(&drivetemp_miscdev);
 	scsi_unregister_interface(&drivetemp_interface);
+	cancel_delayed_work_sync(&drivetemp_refresh_work);
+	destroy_workqueue(drivetemp_wq);
+	debugfs_remove_recursive(drivetemp_debugfs);
+	drivetemp_trace_free(&drivetemp_capture_list);
+	drivetemp_trace_free(&drivetemp_replay_list);
+	drivetemp_cache_free();
 }
 
 module_init(drivetemp_init);
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace interface of the drivetemp character device
+ *
+ * /dev/drivetemp reports the temperatures of a set of drives with a single
+ * request. Drives are identified by the index of their hwmon device, i.e.
+ * N in /sys/class/hwmon/hwmonN.
+ *
+ * Requests are issued either synchronously with the DRIVETEMP_IOC_QUERY
+ * ioctl, or asynchronously as io_uring passthrough command with cmd_op set
+ * to DRIVETEMP_IOC_QUERY and struct drivetemp_query in the command area of
+ * the submission queue entry.
+ */
+#ifndef _UAPI_LINUX_DRIVETEMP_H
+#define _UAPI_LINUX_DRIVETEMP_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define DRIVETEMP_MAX_QUERY	4096
+
+/**
+ * struct drivetemp_result - temperature of one drive
+ * @hwmon:	hwmon device index, set by the caller
+ * @status:	0 on success, or negative error code
+ * @temp:	temperature in milli-degrees Celsius
+ * @age_ms:	age of the reported temperature in milli-seconds
+ */
+struct drivetemp_result {
+	__u32 hwmon;
+	__s32 status;
+	__s32 temp;
+	__u32 age_ms;
+};
+
+/**
+ * struct drivetemp_query - batched temperature query
+ * @results:	pointer to an array of struct drivetemp_result
+ * @count:	number of entries in @results, up to DRIVETEMP_MAX_QUERY
+ * @max_age_ms:	freshness bound. Temperatures older than this are read
+ *		from the drive; younger ones are reported from the cache.
+ */
+struct drivetemp_query {
+	__u64 results;
+	__u32 count;
+	__u32 max_age_ms;
+};
+
+#define DRIVETEMP_IOC_QUERY	_IOWR(0xd7, 0x01, struct drivetemp_query)
+
+#endif /* _UAPI_LINUX_DRIVETEMP_H */
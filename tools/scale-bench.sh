@@ -0,0 +1,141 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# Measure how drivetemp scales with the number of drives, from 1 up to
+# 4096 emulated SAT drives created with scsi_debug. Drive commands are
+# served from replay records captured from a real drive, with the device
+# field of the records set to '*' (see "Capture and replay" in README).
+#
+# Usage: scale-bench.sh records [max_drives]
+#
+# Must be run as root with debugfs mounted, and with drivetemp and
+# scsi_debug available to modprobe but not loaded. Prints one CSV line per
+# number of drives:
+#
+#   drives	number of emulated drives
+#   init_ns	module load time with the drives present. Replay records
+#		can only be loaded after the module, so identification fails
+#		at its first command; this is the cost of the attach path.
+#   probe_ns	total and longest probe, from the stats file, and wall time
+#   probe_max_ns	from loading scsi_debug until all drives were probed.
+#		The longest probe includes other drives bound at load time.
+#   probe_wall_ns
+#   remove_ns	total and longest removal, and wall time of unloading
+#   remove_max_ns	scsi_debug
+#   remove_wall_ns
+#   bytes	memory allocated by drivetemp itself for the drives, from the
+#		stats file
+#   slab_kb	unreclaimable slab growth attributable to drivetemp: growth
+#		while probing, minus the growth caused by scsi_debug alone
+#		for the same number of drives. Includes hwmon devices and
+#		their sysfs attributes.
+#   slab_left_kb	unreclaimable slab growth left after all drives were
+#		removed, relative to before they were added
+
+set -e
+
+records=$1
+max=${2:-4096}
+dbg=/sys/kernel/debug/drivetemp
+timeout=600
+
+if [ -z "$records" ] || [ ! -r "$records" ]; then
+	echo "usage: $0 records [max_drives]" >&2
+	exit 1
+fi
+
+now_ns() {
+	date +%s%N
+}
+
+slab_kb() {
+	awk '$1 == "SUnreclaim:" { print $2 }' /proc/meminfo
+}
+
+dt_stat() {
+	awk -v k="$1" '$1 == k { print $2 }' "$dbg/stats"
+}
+
+# Number of SCSI devices of the scsi_debug host
+sdebug_devices() {
+	local h
+
+	for h in /sys/class/scsi_host/host*; do
+		if [ "$(cat "$h/proc_name")" = scsi_debug ]; then
+			ls -d /sys/class/scsi_device/"${h##*host}":* 2>/dev/null |
+				wc -l
+			return
+		fi
+	done
+	echo 0
+}
+
+# wait_for <command> <value>: wait until the command prints value
+wait_for() {
+	local start=$SECONDS
+
+	until [ "$($1)" -ge "$2" ]; do
+		if [ $((SECONDS - start)) -ge $timeout ]; then
+			echo "timeout waiting for $1 to reach $2" >&2
+			exit 1
+		fi
+		sleep 0.1
+	done
+}
+
+probes() {
+	dt_stat probes
+}
+
+sdebug_load() {
+	local n=$1 luns=$(($1 < 16 ? $1 : 16))
+
+	modprobe scsi_debug num_tgts=$((n / luns)) max_luns=$luns \
+		no_uld=1 ptype=0 dev_size_mb=1
+}
+
+echo "drives,init_ns,probe_ns,probe_max_ns,probe_wall_ns,remove_ns,remove_max_ns,remove_wall_ns,bytes,slab_kb,slab_left_kb"
+
+for ((n = 1; n <= max; n *= 2)); do
+	# scsi_debug alone, as baseline for memory
+	s0=$(slab_kb)
+	sdebug_load $n
+	wait_for sdebug_devices $n
+	base=$(($(slab_kb) - s0))
+
+	# Module load with the drives present
+	modprobe drivetemp replay=1
+	init_ns=$(dt_stat init_ns)
+	rmmod drivetemp
+	rmmod scsi_debug
+
+	# Probe, memory, and removal
+	modprobe drivetemp replay=1
+	cat "$records" > "$dbg/replay"
+
+	# Other drives in the system may already be bound
+	p0=$(probes)
+	probe_ns=$(dt_stat probe_ns)
+	bytes=$(dt_stat bytes)
+	remove_ns=$(dt_stat remove_ns)
+
+	s0=$(slab_kb)
+	t0=$(now_ns)
+	sdebug_load $n
+	wait_for probes $((p0 + n))
+	probe_wall=$(($(now_ns) - t0))
+	slab=$(($(slab_kb) - s0 - base))
+	probe_ns=$(($(dt_stat probe_ns) - probe_ns))
+	probe_max_ns=$(dt_stat probe_max_ns)
+	bytes=$(($(dt_stat bytes) - bytes))
+
+	t0=$(now_ns)
+	rmmod scsi_debug
+	remove_wall=$(($(now_ns) - t0))
+	slab_left=$(($(slab_kb) - s0))
+	remove_ns=$(($(dt_stat remove_ns) - remove_ns))
+	remove_max_ns=$(dt_stat remove_max_ns)
+	rmmod drivetemp
+
+	echo "$n,$init_ns,$probe_ns,$probe_max_ns,$probe_wall,$remove_ns,$remove_max_ns,$remove_wall,$bytes,$slab,$slab_left"
+done